@@ -2,22 +2,46 @@
 #include <GL/gl.h>
 #include <GLFW/glfw3.h>
 
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <linux/io_uring.h>
 #include <linux/videodev2.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "stb_image.h"
 
 
 enum supported_capture_mode{
     capture_mode_read,
     capture_mode_mmap,
+    capture_mode_userptr,
+    // read() with a read in flight for every free buffer, submitted and reaped in batches through io_uring. For
+    // read() capable devices (e.g. v4l2loopback) and files of raw frames.
+    capture_mode_uring,
 };
 
 enum supported_capture_format{
@@ -25,6 +49,93 @@ enum supported_capture_format{
     capture_format_YUYV,
     capture_format_MJPEG,
     capture_format_NV12,
+    // three planes: Y, then V and U at half resolution. Multi-planar V4L2 devices deliver each plane in its own
+    // buffer, everywhere else the planes follow each other in one buffer.
+    capture_format_YVU420M,
+};
+
+// How the mmap ring trades latency against dropped frames.
+enum frame_reader_policy {
+    // capture_buffers_length buffers (2 if not set), frames are handed out in driver order
+    reader_policy_default,
+    // 2 buffers, every read hands out the newest frame and requeues older ones right away
+    reader_policy_lowest_latency,
+    // a deep queue so a stalling consumer does not make the driver drop frames
+    reader_policy_no_drop,
+};
+
+#define READER_DEFAULT_BUFFERS 2
+#define READER_LOWEST_LATENCY_BUFFERS 2
+#define READER_NO_DROP_BUFFERS 8
+// a mailbox needs one buffer for the consumer, one pending and one for the driver to write to
+#define READER_MAILBOX_BUFFERS 3
+// upper bound for the ring depth, the capture thread tracks buffers in a 64 bit mask
+#define READER_MAX_BUFFERS 64
+
+// How the capture thread hands frames to the consumer
+enum frame_reader_handoff {
+    // every frame is queued in order, see ring_overflows
+    reader_handoff_ring,
+    // latest frame wins, a pending frame the consumer did not take yet is replaced by a newer one
+    reader_handoff_mailbox,
+};
+
+// Whether a thread setting of the options took effect, see frame_reader_stats
+enum frame_reader_setting {
+    // not asked for, or the thread it is for did not start yet
+    reader_setting_unused,
+    reader_setting_applied,
+    // e.g. none of the CPUs is online, or SCHED_FIFO/SCHED_RR without CAP_SYS_NICE or RLIMIT_RTPRIO
+    reader_setting_failed,
+};
+
+// Running counters, see reader_stats
+struct frame_reader_stats {
+    // frames taken from the driver, including the ones dropped by the reader
+    uint64_t frames;
+    // frames the driver never delivered (gaps in the sequence numbers), e.g. because no buffer was queued
+    uint64_t driver_drops;
+    // frames the reader took from the driver but never handed to the consumer, the sum of the next three
+    uint64_t consumer_drops;
+    // reader_policy_lowest_latency and reader_drain_newest: older frames skipped for a newer one
+    uint64_t frames_skipped;
+    // capture thread: see frame_reader.ring_overflows and frame_reader.frames_superseded
+    uint64_t ring_overflows;
+    uint64_t frames_superseded;
+    // frames flagged with V4L2_BUF_FLAG_ERROR, they are still handed out
+    uint64_t error_frames;
+    // reader_frame_acquire calls which copied the frame because pinning it would have starved the source
+    uint64_t frames_copied;
+    // buffers the source refused to take back, they are missing from its queue until the stream is restarted
+    uint64_t requeue_failures;
+    // watchdog: streams which delivered nothing for watchdog_intervals frame intervals, failed reads, and how they
+    // were recovered
+    uint64_t stalls;
+    uint64_t device_errors;
+    uint64_t stream_restarts;
+    uint64_t device_reopens;
+    uint64_t recovery_failures;
+    // V4L2 events taken from the device, and the ones reader_next_event never handed out because the queue was full
+    uint64_t events;
+    uint64_t events_dropped;
+    // source changes the reader followed by switching to the new format, and the ones where that failed
+    uint64_t source_changes;
+    uint64_t source_change_failures;
+    // whether capture_cpus, capture_policy and decode_cpus of the options took effect
+    enum frame_reader_setting capture_affinity;
+    enum frame_reader_setting capture_scheduling;
+    enum frame_reader_setting decode_affinity;
+};
+
+// Counters of the shared buffer pool, see reader_pool_stats
+struct frame_reader_pool_stats {
+    // blocks mapped from the system and blocks handed out again from the pool
+    uint64_t allocations;
+    uint64_t reuses;
+    // blocks unmapped because the pool was full or trimmed
+    uint64_t releases;
+    size_t cached_bytes;
+    size_t used_bytes;
 };
 
 struct frame_reader_buffers {
@@ -32,300 +143,4153 @@ struct frame_reader_buffers {
     size_t length;
 };
 
+// reader_buffer_alloc flags: back the buffer with huge pages, fewer TLB misses on full frame passes
+#define READER_ALLOC_HUGEPAGES 1
+// lock the buffer in memory so it is never paged out
+#define READER_ALLOC_MLOCK 2
+#define READER_HUGEPAGE_SIZE ((size_t)2 << 20)
+
+// frame_reader_options.events: V4L2 events to subscribe to. The device signals them with POLLPRI on its fd.
+// the input signal changed, e.g. a new resolution on an HDMI grabber or a loopback producer, the reader switches to
+// the new format by itself
+#define READER_EVENT_SOURCE_CHANGE 1
+// the device will deliver no more frames, reads end with ENODATA
+#define READER_EVENT_EOS 2
+// a control of the device changed
+#define READER_EVENT_CTRL 4
+
+// A set of CPUs, bit n % 64 of bits[n / 64] stands for CPU n
+#define READER_MAX_CPUS 1024
+struct frame_reader_cpus {
+    uint64_t bits[READER_MAX_CPUS / 64];
+};
+
+struct frame_reader_options {
+    enum frame_reader_policy policy;
+    // number of buffers to request from the driver, 0 picks the policy's default
+    size_t capture_buffers_length;
+    // capture_mode_userptr only: application owned, page aligned buffers of at least frame_size bytes each. The
+    // driver writes directly into them, they have to stay valid until reader_destroy.
+    struct frame_reader_buffers* userptr_buffers;
+    size_t userptr_buffers_length;
+    // capture_mode_mmap only: export every capture buffer as a DMABUF (VIDIOC_EXPBUF)
+    bool export_dmabuf;
+    // READER_ALLOC_* flags for the buffers the reader allocates itself (decode, read and generated frames)
+    unsigned alloc_flags;
+    // how reader_thread_pop hands out frames
+    enum frame_reader_handoff handoff;
+    // frames reader_frame_acquire may pin at the same time instead of copying them, the reader requests that many
+    // buffers on top of the two the source needs to keep capturing
+    size_t pinned_handles;
+    // restart the stream if no frame came for this many frame intervals or a read failed, reopen the device if that
+    // does not help. 0 disables the watchdog, errors are passed on then.
+    unsigned watchdog_intervals;
+    // V4L2 only: device node the watchdog reopens after the device went away, e.g. on a USB reset. Has to stay valid
+    // as long as the reader.
+    const char* device_path;
+    // capture thread (reader_thread_start): the CPUs to pin it to, none leaves it to the scheduler, and SCHED_FIFO or
+    // SCHED_RR with capture_priority to run it under. SCHED_OTHER keeps the normal scheduler.
+    struct frame_reader_cpus capture_cpus;
+    int capture_policy;
+    int capture_priority;
+    // the CPUs to pin the thread which decodes to, see reader_decode_thread_setup
+    struct frame_reader_cpus decode_cpus;
+    // V4L2 only (not in capture_mode_uring): READER_EVENT_* to subscribe to, see reader_next_event. Devices which do
+    // not support an event never send it.
+    unsigned events;
+};
+
+enum frame_reader_event_type {
+    reader_event_source_change,
+    reader_event_eos,
+    reader_event_ctrl,
+};
+
+// An event of the device, see reader_next_event
+struct frame_reader_event {
+    enum frame_reader_event_type type;
+    // V4L2_EVENT_SRC_CH_* or V4L2_EVENT_CTRL_CH_* flags
+    uint32_t changes;
+    // sequence number and CLOCK_MONOTONIC timestamp of the driver
+    uint32_t sequence;
+    struct timespec timestamp;
+    // reader_event_source_change: whether the reader switched to the new format, and the format it captures now.
+    // errno of the failed switch otherwise, the reader then keeps the old format (or has no frames at all).
+    bool reconfigured;
+    int error;
+    int fmt;
+    int width;
+    int height;
+    // reader_event_ctrl: the control and its new value
+    uint32_t ctrl_id;
+    int64_t value;
+};
+
+#define READER_MAX_EVENTS 16
+
+struct frame_reader;
+
+// Where frames come from. Every reader has a source, reader_new_with_options creates readers backed by a V4L2
+// device (frame_source_v4l2), reader_new_replay by a recording (frame_source_replay).
+struct frame_source {
+    const char* name;
+    // allocate the buffers and the frames table (reader_alloc_frames), reader->fd has to become pollable
+    int (*open)(struct frame_reader* reader, const struct frame_reader_options* options, const void* source_options);
+    int (*start)(struct frame_reader* reader);
+    // take the next frame without waiting, NULL with errno EAGAIN if there is none
+    struct frame_reader_frame* (*read)(struct frame_reader* reader);
+    // the consumer is done with frame, its buffer can be reused
+    int (*release)(struct frame_reader* reader, struct frame_reader_frame* frame);
+    // frames which were not released are reclaimed
+    int (*stop)(struct frame_reader* reader);
+    // free everything open allocated
+    void (*close)(struct frame_reader* reader);
+    // optional, switch the stopped source to another format and resolution (reader_reconfigure). Only buffers whose
+    // size changes are made again, the fd stays the same.
+    int (*reconfigure)(struct frame_reader* reader, enum supported_capture_format fmt, int width, int height);
+    // optional, open the device again after it went away (the watchdog), reader->fd has to keep its number
+    int (*reopen)(struct frame_reader* reader);
+    // optional, what the stopped source delivers after a source change (reader_apply_source_change)
+    int (*source_format)(struct frame_reader* reader, enum supported_capture_format* fmt, int* width, int* height);
+};
+
+// frame_source_v4l2 options
+struct frame_source_v4l2_options {
+    int fd;
+    enum supported_capture_mode mode;
+};
+
+// planes of the multi-planar formats
+#define READER_MAX_PLANES 3
+
+struct frame_reader_plane {
+    void* ptr;
+    size_t length;
+    size_t bytesused;
+};
+
+// A frame handed out by the reader, it stays valid until the next read.
+struct frame_reader_frame {
+    // the first plane, the whole frame for single planar formats
+    void* ptr;
+    // summed over all planes, like bytesused
+    size_t length;
+    int index;
+    // exported DMABUF of the underlying capture buffer or -1, owned by the reader
+    int dmabuf_fd;
+    // payload size, less than length for compressed formats
+    size_t bytesused;
+    // frame counter of the driver, gaps mean the driver dropped frames
+    uint32_t sequence;
+    // V4L2_BUF_FLAG_*, the timestamp clock is in V4L2_BUF_FLAG_TIMESTAMP_MASK
+    uint32_t flags;
+    struct timeval timestamp;
+    // pointers to the planes, in the capture buffers, so planar formats can be read without a copy. Single planar
+    // formats have one plane.
+    size_t planes_length;
+    struct frame_reader_plane planes[READER_MAX_PLANES];
+};
+
+// A counted reference to a frame, see reader_frame_acquire
+struct frame_reader_handle {
+    // ptr points into the capture buffer or to the handle's own copy of the data
+    struct frame_reader_frame frame;
+    struct frame_reader* reader;
+    atomic_uint refs;
+    // the data was copied and the capture buffer went back to the source right away
+    bool copied;
+};
+
 struct frame_reader {
+    // pollable, readable when the source has a frame
     int fd;
+    // V4L2 only: the device fd the reader was created with, owned by the caller. The same as fd, except in
+    // capture_mode_uring where fd is an eventfd the ring signals completed reads on.
+    int device_fd;
+    const struct frame_source* source;
+    void* source_data;
     enum supported_capture_mode capture_mode;
     int fmt;
     int width;
     int height;
     int frame_size;
+    // mask of the frames handed out by the last read or drain
+    uint64_t capture_buffers_current;
+    // V4L2_BUF_TYPE_VIDEO_CAPTURE or V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+    enum v4l2_buf_type buf_type;
+    // driver side planes per buffer, 1 unless the multi-planar API is used
+    size_t buffer_planes_length;
     union {
-        struct {
-            int capture_buffers_current_index;
-            struct frame_reader_buffers* capture_buffers;
-        };
+        // buffer_planes_length entries per buffer, one for each plane
+        struct frame_reader_buffers* capture_buffers;
         void* capture_buffer;
     };
+    // the number of buffers the source granted, may differ from capture_buffers_requested
     size_t capture_buffers_length;
+    size_t capture_buffers_requested;
+    enum frame_reader_policy policy;
+    // the options the reader was created with, reader_reconfigure opens the source again with them
+    struct frame_reader_options options;
+    // one frame per capture buffer
+    struct frame_reader_frame* frames;
+    // one handle per capture buffer, shared by everyone who acquired the frame in it
+    struct frame_reader_handle* handles;
+    // holds on every buffer: one for the consumer which read it plus one while handles to it exist. The buffer goes
+    // back to the source when the last hold is put (reader_buffer_put).
+    atomic_uint buffer_holds[READER_MAX_BUFFERS];
+    // buffers pinned by handles
+    atomic_size_t buffers_pinned;
+    atomic_uint_least64_t frames_copied;
+    // read mode has no driver sequence numbers, they are counted here
+    uint32_t read_sequence;
+    // sequence number of the last dequeued frame, used to detect gaps
+    bool last_sequence_valid;
+    uint32_t last_sequence;
+    atomic_uint_least64_t frames_dequeued;
+    atomic_uint_least64_t driver_drops;
+    atomic_uint_least64_t frames_skipped;
+    atomic_uint_least64_t error_frames;
+    atomic_uint_least64_t requeue_failures;
+    // nominal time between frames in microseconds, 0 if the source does not know it
+    int64_t frame_interval;
+    // watchdog (options.watchdog_intervals): when the last frame came or recovery was last tried, and when it was last
+    // tried because of an error, CLOCK_MONOTONIC microseconds
+    int64_t last_frame_time;
+    int64_t recovery_time;
+    atomic_uint_least64_t stalls;
+    atomic_uint_least64_t device_errors;
+    atomic_uint_least64_t stream_restarts;
+    atomic_uint_least64_t device_reopens;
+    atomic_uint_least64_t recovery_failures;
     int texture_format;
     void* decode_buffer;
+    // decode_buffer (if set) is borrowed from the shared pool, the read buffer is allocated with reader_buffer_alloc
+    struct frame_reader_buffers read_allocation;
+    // requested READER_ALLOC_* flags and the ones the decode buffer actually got
+    unsigned alloc_flags;
+    int decode_buffer_flags;
+
+    // capture thread (reader_thread_start), it owns the fd while running
+    pthread_t capture_thread;
+    bool capture_thread_running;
+    atomic_bool capture_thread_stop;
+    // errno of the failure which ended the capture thread, 0 while it is fine
+    atomic_int capture_thread_error;
+    enum frame_reader_handoff handoff;
+    // wakes the capture thread, e.g. when buffers were released
+    int wake_fd;
+    // signals the consumer that frames were published
+    int ready_fd;
+    // single producer (capture thread), single consumer ring of buffer indices
+    struct {
+        atomic_size_t head;
+        atomic_size_t tail;
+        int slots[READER_MAX_BUFFERS];
+    } ring;
+    // reader_handoff_mailbox: index of the pending frame or -1
+    atomic_int mailbox;
+    // buffers nobody holds any more, requeued by whoever owns the source: the capture thread if it runs, the reading
+    // thread otherwise
+    atomic_uint_least64_t released;
+    // number of buffers currently queued in the driver, only touched by the capture thread
+    size_t queued;
+    atomic_uint_least64_t frames_published;
+    // frames given straight back to the driver because the consumer held on to all other buffers
+    atomic_uint_least64_t ring_overflows;
+    // reader_handoff_mailbox: pending frames replaced by a newer one before the consumer took them
+    atomic_uint_least64_t frames_superseded;
+    // enum frame_reader_setting, set by the capture thread and by reader_decode_thread_setup
+    atomic_int capture_affinity;
+    atomic_int capture_scheduling;
+    atomic_int decode_affinity;
 
+    // events taken from the device by the owner of the source, waiting for reader_next_event
+    pthread_mutex_t events_lock;
+    struct frame_reader_event events[READER_MAX_EVENTS];
+    size_t events_head;
+    size_t events_tail;
+    atomic_uint_least64_t events_received;
+    atomic_uint_least64_t events_dropped;
+    atomic_uint_least64_t source_changes;
+    atomic_uint_least64_t source_change_failures;
+    // the source changed (the event is queued once the reader followed), no frame is handed out until the reader
+    // switched to the new format (reader_apply_source_change)
+    atomic_bool source_change_pending;
+    struct frame_reader_event source_change;
+    // V4L2_EVENT_EOS came, reads end with ENODATA once no frame is left
+    atomic_bool end_of_stream;
 };
 
-struct frame_reader* reader_new(int fd, enum supported_capture_mode mode, enum supported_capture_format fmt, int width, int height, int frame_size) {
-    struct frame_reader* fr = calloc(1, sizeof(struct frame_reader));
-    fr->fd = fd;
-    fr->capture_mode = mode;
+size_t reader_policy_buffers(enum frame_reader_policy policy) {
+    switch (policy) {
+        case reader_policy_default:
+            return READER_DEFAULT_BUFFERS;
+        case reader_policy_lowest_latency:
+            return READER_LOWEST_LATENCY_BUFFERS;
+        case reader_policy_no_drop:
+            return READER_NO_DROP_BUFFERS;
+    }
+    return READER_DEFAULT_BUFFERS;
+}
 
-    fr->fmt = fmt;
-    fr->width = width;
-    fr->height = height;
-    fr->frame_size = frame_size;
+// CLOCK_MONOTONIC in microseconds
+int64_t reader_monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-    switch (fmt) {
-        case capture_format_RGB24:
-            fr->texture_format = GL_RGB;
-            break;
-        case capture_format_YUYV:
-        case capture_format_MJPEG:
-        case capture_format_NV12:
-            fr->texture_format = GL_RGB;
-            fr->decode_buffer = malloc(sizeof(char) * width *height * 3);
-            break;
+// Stamp a frame with a reader_monotonic_us time, for sources without a driver which stamps them
+void reader_set_timestamp(struct frame_reader_frame* frame, int64_t time) {
+    frame->timestamp.tv_sec = time / 1000000;
+    frame->timestamp.tv_usec = time % 1000000;
+}
+
+// Fault every page of a fresh mapping in for writing
+void reader_buffer_prefault(void* ptr, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+    if (0 == madvise(ptr, length, MADV_POPULATE_WRITE)) {
+        return;
     }
+#endif
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < length; offset += page_size) {
+        ((volatile char*)ptr)[offset] = 0;
+    }
+}
 
-    switch (mode) {
-        case capture_mode_read:
-            fr->capture_buffer = malloc(sizeof(char) * frame_size);
-            fr->capture_buffers_length = 1;
-            break;
+// Allocate a page aligned (so also aligned for any SIMD load) and pre-faulted buffer, the first frame should not pay
+// for page faults the later ones don't have. With READER_ALLOC_HUGEPAGES explicit huge pages are tried first, then
+// transparent huge pages. Returns the READER_ALLOC_* flags that took effect or -1.
+int reader_buffer_alloc(struct frame_reader_buffers* buffer, size_t length, unsigned flags) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    int result = 0;
+    void* ptr = MAP_FAILED;
+    size_t aligned_length = (length + page_size - 1) / page_size * page_size;
 
-        case capture_mode_mmap:
-            fr->capture_buffers_current_index = -1;
-            fr->capture_buffers_length = 2;
-            struct v4l2_requestbuffers requestbuffers = {0};
-            requestbuffers.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            requestbuffers.memory = V4L2_MEMORY_MMAP;
-            requestbuffers.count = fr->capture_buffers_length;
-            int request_status = ioctl(fr->fd, VIDIOC_REQBUFS, &requestbuffers);
-            // TODO handle error
-            (void) request_status;
-            if(requestbuffers.count < fr->capture_buffers_length) {
-                // TODO handle error
+    if (flags & READER_ALLOC_HUGEPAGES) {
+        size_t huge_length = (length + READER_HUGEPAGE_SIZE - 1) / READER_HUGEPAGE_SIZE * READER_HUGEPAGE_SIZE;
+        // needs reserved huge pages (vm.nr_hugepages), MAP_POPULATE fails right away if there are not enough
+        ptr = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (MAP_FAILED != ptr) {
+            aligned_length = huge_length;
+            result |= READER_ALLOC_HUGEPAGES;
+        } else {
+            // transparent huge pages only back huge page aligned ranges, map more and trim to alignment
+            void* area = mmap(NULL, huge_length + READER_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (MAP_FAILED != area) {
+                uintptr_t start = ((uintptr_t)area + READER_HUGEPAGE_SIZE - 1) & ~(uintptr_t)(READER_HUGEPAGE_SIZE - 1);
+                size_t head = start - (uintptr_t)area;
+                if (head > 0) {
+                    munmap(area, head);
+                }
+                munmap((char*)start + huge_length, READER_HUGEPAGE_SIZE - head);
+                ptr = (void*)start;
+                aligned_length = huge_length;
+                if (0 == madvise(ptr, aligned_length, MADV_HUGEPAGE)) {
+                    result |= READER_ALLOC_HUGEPAGES;
+                }
+                reader_buffer_prefault(ptr, aligned_length);
             }
+        }
+    }
 
-            fr->capture_buffers = calloc(fr->capture_buffers_length, sizeof(struct frame_reader_buffers));
-
-            for (size_t i = 0; i < fr->capture_buffers_length; ++i) {
-                struct v4l2_buffer buf = {0};
+    if (MAP_FAILED == ptr) {
+        // MAP_POPULATE faults all pages in now instead of on the first frames
+        ptr = mmap(NULL, aligned_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (MAP_FAILED == ptr) {
+            return -1;
+        }
+    }
 
-                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory      = V4L2_MEMORY_MMAP;
-                buf.index       = i;
+    // limited by RLIMIT_MEMLOCK, the buffer is still usable without the lock
+    if ((flags & READER_ALLOC_MLOCK) && 0 == mlock(ptr, aligned_length)) {
+        result |= READER_ALLOC_MLOCK;
+    }
 
-                int query_status = ioctl(fr->fd, VIDIOC_QUERYBUF, &buf);
-                // TODO error handling
-                (void) query_status;
+    buffer->ptr = ptr;
+    buffer->length = aligned_length;
+    return result;
+}
 
-                fr->capture_buffers[i].ptr = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fr->fd, buf.m.offset);
-                fr->capture_buffers[i].length = buf.length;
+// Unmapping also drops the lock
+void reader_buffer_free(struct frame_reader_buffers* buffer) {
+    if (buffer->ptr != NULL) {
+        munmap(buffer->ptr, buffer->length);
+        buffer->ptr = NULL;
+        buffer->length = 0;
+    }
+}
 
-                if (MAP_FAILED == fr->capture_buffers[i].ptr) {
-                    // TODO error handling
-                }
+// Allocate a pool of buffers usable with capture_mode_userptr, see reader_buffer_alloc for flags
+struct frame_reader_buffers* reader_userptr_pool_new(size_t count, size_t length, unsigned flags) {
+    struct frame_reader_buffers* pool = calloc(count, sizeof(struct frame_reader_buffers));
+    if (pool == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (-1 == reader_buffer_alloc(&pool[i], length, flags)) {
+            for (size_t j = 0; j < i; ++j) {
+                reader_buffer_free(&pool[j]);
             }
-            break;
+            free(pool);
+            return NULL;
+        }
     }
-
-    return fr;
+    return pool;
 }
 
-void reader_start(struct frame_reader* reader) {
-
-    switch (reader->capture_mode) {
-        case capture_mode_read:
-            return;
-        case capture_mode_mmap:
-            // but all the buffers in the queue
-            for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
-                struct v4l2_buffer buf = {0};
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
-                buf.index = i;
-                ioctl(reader->fd, VIDIOC_QBUF, &buf);
-            }
-            // start capturing
-            enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            int stream_on_status = ioctl(reader->fd, VIDIOC_STREAMON, &type);
-            // TODO error handling
-            (void) stream_on_status;
-            break;
+void reader_userptr_pool_free(struct frame_reader_buffers* pool, size_t count) {
+    if (pool == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        reader_buffer_free(&pool[i]);
     }
+    free(pool);
 }
 
+// Shared pool for frame sized buffers (decode outputs, conversion scratch, frame copies and the images stb_image
+// allocates), returned blocks are kept per size class and handed to the next borrower of that size. Once every reader
+// is running no buffer is mapped or faulted in anymore, and readers that come and go reuse each other's memory.
+// Size classes step by a quarter of a power of two, so a frame wastes at most 25%, e.g. 1920x1080 RGB lands in 6 MiB.
+#define READER_POOL_MIN_SIZE ((size_t)4 << 10)
+#define READER_POOL_CLASSES 65
+// freed blocks beyond this are given back to the system
+#define READER_POOL_MAX_CACHED ((size_t)256 << 20)
 
-void* reader_read_raw(struct frame_reader* reader) {
-    switch (reader->capture_mode) {
-        case capture_mode_read:
-            int bytes = read(reader->fd, reader->capture_buffer, reader->frame_size);
-            if (bytes == -1) {
-                switch (errno) {
-                    case EAGAIN:
-                        // skip frame read, this time preset old data again.
-                        return reader->capture_buffer;
-                    default:
-                        return NULL;
-                }
-            }
+// Precedes every pooled block, keeps the payload 64 byte aligned
+struct reader_pool_block {
+    struct reader_pool_block* next;
+    size_t length;
+    int size_class;
+    // READER_ALLOC_* flags requested by the first borrower and the ones the block got
+    unsigned flags;
+    int achieved_flags;
+    char padding[64 - sizeof(void*) - sizeof(size_t) - 3 * sizeof(int)];
+};
 
-            if (bytes != reader->frame_size) {
-                return NULL;
-            }
+struct reader_pool {
+    pthread_mutex_t lock;
+    struct reader_pool_block* free[READER_POOL_CLASSES];
+    struct frame_reader_pool_stats stats;
+};
 
-            return reader->capture_buffer;
-        case capture_mode_mmap:
-            struct v4l2_buffer buf = {0};
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_MMAP;
-
-            // queue last used buffer if one was in use
-            if (reader->capture_buffers_current_index != -1) {
-                buf.index = reader->capture_buffers_current_index;
-                if (-1 == ioctl(reader->fd, VIDIOC_QBUF, &buf)) {
-                    // TODO error handling
-                    return NULL;
-                }
-                reader->capture_buffers_current_index = -1;
-            }
+struct reader_pool reader_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-            // dequeue buffer
-            if (-1 == ioctl(reader->fd, VIDIOC_DQBUF, &buf)) {
-                // TODO error handling
-                return NULL;
-            }
-            reader->capture_buffers_current_index = buf.index;
-            return reader->capture_buffers[reader->capture_buffers_current_index].ptr;
+size_t reader_pool_class_size(int size_class) {
+    return (READER_POOL_MIN_SIZE / 4 * (4 + size_class % 4)) << (size_class / 4);
+}
+
+// Smallest class holding size bytes, -1 if it is too large to pool
+int reader_pool_class(size_t size) {
+    for (int size_class = 0; size_class < READER_POOL_CLASSES; ++size_class) {
+        if (reader_pool_class_size(size_class) >= size) {
+            return size_class;
+        }
     }
-    return NULL;
+    return -1;
 }
 
-#define cc(v) ((v < 0) ? 0 : (255 < v) ? 255 : v)
+// Borrow a 64 byte aligned buffer of at least size bytes, see reader_buffer_alloc for flags
+void* reader_pool_alloc(size_t size, unsigned flags) {
+    size_t length = size + sizeof(struct reader_pool_block);
+    int size_class = reader_pool_class(length);
 
-void reader_decode_nv12(unsigned char* in, unsigned char* out, size_t width, size_t height) {
+    if (size_class >= 0) {
+        pthread_mutex_lock(&reader_pool.lock);
+        struct reader_pool_block** link = &reader_pool.free[size_class];
+        while (*link != NULL && (*link)->flags != flags) {
+            link = &(*link)->next;
+        }
+        struct reader_pool_block* block = *link;
+        if (block != NULL) {
+            *link = block->next;
+            reader_pool.stats.reuses++;
+            reader_pool.stats.cached_bytes -= block->length;
+            reader_pool.stats.used_bytes += block->length;
+            pthread_mutex_unlock(&reader_pool.lock);
+            return block + 1;
+        }
+        pthread_mutex_unlock(&reader_pool.lock);
+        length = reader_pool_class_size(size_class);
+    }
 
-    // https://learn.microsoft.com/en-gb/windows/win32/medfound/recommended-8-bit-yuv-formats-for-video-rendering#nv12
-    // https://fourcc.org/fccyvrgb.php
-    // https://gist.github.com/dmitriykovalev/980f4bcf68ac4667e89d4d989de21835
-    size_t i, j = 0;
+    struct frame_reader_buffers buffer;
+    int achieved_flags = reader_buffer_alloc(&buffer, length, flags);
+    if (achieved_flags == -1) {
+        return NULL;
+    }
+    struct reader_pool_block* block = buffer.ptr;
+    block->next = NULL;
+    block->length = buffer.length;
+    block->size_class = size_class;
+    block->flags = flags;
+    block->achieved_flags = achieved_flags;
 
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++) {
+    pthread_mutex_lock(&reader_pool.lock);
+    reader_pool.stats.allocations++;
+    reader_pool.stats.used_bytes += block->length;
+    pthread_mutex_unlock(&reader_pool.lock);
+    return block + 1;
+}
 
-            int index = i * width + j;
-            int offset = height * width, I = i/2, J = j/2, W = width/2;
+// Return a buffer from reader_pool_alloc, NULL is ignored
+void reader_pool_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct reader_pool_block* block = (struct reader_pool_block*)ptr - 1;
 
-            int y = in[index] - 16;
-            int u = in[offset + (I*W+J)*2] - 128;
-            int v = in[offset + (I*W+J)*2+1] - 128;
+    pthread_mutex_lock(&reader_pool.lock);
+    reader_pool.stats.used_bytes -= block->length;
+    if (block->size_class >= 0 && reader_pool.stats.cached_bytes + block->length <= READER_POOL_MAX_CACHED) {
+        block->next = reader_pool.free[block->size_class];
+        reader_pool.free[block->size_class] = block;
+        reader_pool.stats.cached_bytes += block->length;
+        pthread_mutex_unlock(&reader_pool.lock);
+        return;
+    }
+    reader_pool.stats.releases++;
+    pthread_mutex_unlock(&reader_pool.lock);
 
-            out[index * 3 + 3] = cc(1.164 * y + 2.018 * u);
-            out[index * 3 + 1] = cc(1.164 * y - 0.813 * v - 0.391 * u);
-            out[index * 3 + 0] = cc(1.164 * y + 1.596 * v);
+    struct frame_reader_buffers buffer = {block, block->length};
+    reader_buffer_free(&buffer);
+}
+
+// realloc for pooled buffers, stays in place while the size class allows it
+void* reader_pool_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return reader_pool_alloc(size, 0);
+    }
+    struct reader_pool_block* block = (struct reader_pool_block*)ptr - 1;
+    size_t capacity = block->length - sizeof(struct reader_pool_block);
+    if (size <= capacity) {
+        return ptr;
+    }
+    void* grown = reader_pool_alloc(size, block->flags);
+    if (grown == NULL) {
+        return NULL;
+    }
+    memcpy(grown, ptr, capacity);
+    reader_pool_free(ptr);
+    return grown;
+}
+
+// READER_ALLOC_* flags the block behind ptr actually got
+int reader_pool_flags(const void* ptr) {
+    return ((const struct reader_pool_block*)ptr - 1)->achieved_flags;
+}
+
+// Give every cached block back to the system, e.g. after the last reader is gone
+void reader_pool_trim(void) {
+    pthread_mutex_lock(&reader_pool.lock);
+    for (int size_class = 0; size_class < READER_POOL_CLASSES; ++size_class) {
+        while (reader_pool.free[size_class] != NULL) {
+            struct reader_pool_block* block = reader_pool.free[size_class];
+            reader_pool.free[size_class] = block->next;
+            reader_pool.stats.cached_bytes -= block->length;
+            reader_pool.stats.releases++;
+            struct frame_reader_buffers buffer = {block, block->length};
+            reader_buffer_free(&buffer);
         }
     }
+    pthread_mutex_unlock(&reader_pool.lock);
 }
 
-void reader_decode_yuyv(unsigned char* in, unsigned char* out, size_t width, size_t height) {
+struct frame_reader_pool_stats reader_pool_stats(void) {
+    pthread_mutex_lock(&reader_pool.lock);
+    struct frame_reader_pool_stats stats = reader_pool.stats;
+    pthread_mutex_unlock(&reader_pool.lock);
+    return stats;
+}
 
-    // https://fourcc.org/fccyvrgb.php
-    size_t i, j = 0;
-    int index, y0, u, y1, v;
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j += 2) {
-            index = i * width + j;
-            y0 = in[index * 2 + 0];
-            u = in[index * 2 + 1];
-            y1 = in[index * 2 + 2];
-            v = in[index * 2 + 3];
+int reader_memory(struct frame_reader* reader) {
+    return reader->capture_mode == capture_mode_userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+}
 
-            out[index * 3 + 0] = cc(1.164*(y0 - 16) + 1.596*(v - 128));
-            out[index * 3 + 1] = cc(1.164*(y0 - 16) - 0.813*(v - 128) - 0.391*(u - 128));
-            out[index * 3 + 2] = cc(1.164*(y0 - 16) + 2.018*(u - 128));
+bool reader_format_multiplanar(enum supported_capture_format fmt) {
+    return fmt == capture_format_YVU420M;
+}
 
-            out[index * 3 + 3] = cc(1.164*(y1 - 16) + 1.596*(v - 128));
-            out[index * 3 + 4] = cc(1.164*(y1 - 16) - 0.813*(v - 128) - 0.391*(u - 128));
-            out[index * 3 + 5] = cc(1.164*(y1 - 16) + 2.018*(u - 128));
-        }
+// The buffer type to capture fmt with. Multi-planar formats need the multi-planar API, and so does every format on
+// devices which only implement that one.
+enum v4l2_buf_type reader_v4l2_buf_type(int fd, enum supported_capture_format fmt) {
+    struct v4l2_capability caps = {0};
+    if (-1 == ioctl(fd, VIDIOC_QUERYCAP, &caps)) {
+        return V4L2_BUF_TYPE_VIDEO_CAPTURE;
     }
+    uint32_t capabilities = (caps.capabilities & V4L2_CAP_DEVICE_CAPS) ? caps.device_caps : caps.capabilities;
+    if ((capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) &&
+        (reader_format_multiplanar(fmt) || !(capabilities & V4L2_CAP_VIDEO_CAPTURE))) {
+        return V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    }
+    return V4L2_BUF_TYPE_VIDEO_CAPTURE;
 }
 
-void reader_decode_mjpeg(unsigned char* in, unsigned char* out, size_t input_size, size_t width, size_t height) {
+// Prepare buf for buffer index, planes has to hold VIDEO_MAX_PLANES entries and live as long as buf
+void reader_v4l2_buffer(struct frame_reader* reader, struct v4l2_buffer* buf, struct v4l2_plane* planes, size_t index) {
+    *buf = (struct v4l2_buffer){0};
+    buf->type = reader->buf_type;
+    buf->memory = reader_memory(reader);
+    buf->index = index;
+    if (reader->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        memset(planes, 0, VIDEO_MAX_PLANES * sizeof(struct v4l2_plane));
+        buf->m.planes = planes;
+        buf->length = reader->buffer_planes_length;
+    }
+}
 
-    int w, h, n_channels;
-    unsigned char* image = stbi_load_from_memory(in, input_size, &w, &h, &n_channels, 3);
+// Hand a buffer (back) to the driver
+int reader_queue_buffer(struct frame_reader* reader, size_t index) {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    reader_v4l2_buffer(reader, &buf, planes, index);
+    if (buf.memory == V4L2_MEMORY_USERPTR) {
+        struct frame_reader_buffers* buffers = &reader->capture_buffers[index * reader->buffer_planes_length];
+        if (reader->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+            for (size_t p = 0; p < reader->buffer_planes_length; ++p) {
+                planes[p].m.userptr = (unsigned long)buffers[p].ptr;
+                planes[p].length = buffers[p].length;
+            }
+        } else {
+            buf.m.userptr = (unsigned long)buffers[0].ptr;
+            buf.length = buffers[0].length;
+        }
+    }
+    return ioctl(reader->device_fd, VIDIOC_QBUF, &buf);
+}
 
-    memcpy(out, image, width*height*3);
+void reader_destroy(struct frame_reader* reader);
+void reader_account_frame(struct frame_reader* reader, uint32_t sequence, uint32_t flags);
 
-    stbi_image_free(image);
+// Allocate one frame per capture buffer, called by the sources. Replaces the frames of an earlier configuration.
+void reader_alloc_frames(struct frame_reader* reader) {
+    free(reader->frames);
+    free(reader->handles);
+    reader->frames = calloc(reader->capture_buffers_length, sizeof(struct frame_reader_frame));
+    reader->handles = calloc(reader->capture_buffers_length, sizeof(struct frame_reader_handle));
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        reader->frames[i].index = i;
+        reader->frames[i].dmabuf_fd = -1;
+        reader->handles[i].reader = reader;
+    }
 }
 
+// read() carries no metadata, stamp the frame the way a driver would
+void reader_stamp_read_frame(struct frame_reader* reader, struct frame_reader_frame* frame, size_t bytes) {
+    frame->bytesused = bytes;
+    frame->sequence = reader->read_sequence++;
+    frame->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    reader_set_timestamp(frame, reader_monotonic_us());
+    reader_account_frame(reader, frame->sequence, frame->flags);
+}
 
-void* reader_read_decode_rgb(struct frame_reader* reader) {
-    enum supported_capture_format format = reader->fmt;
-    switch (format) {
-        case capture_format_RGB24:
-            return reader_read_raw(reader);
-        case capture_format_YUYV:
-            //return reader_read_raw(reader);
-            reader_decode_yuyv(reader_read_raw(reader), reader->decode_buffer, reader->width, reader->height);
-            return reader->decode_buffer;
-        case capture_format_MJPEG:
-            reader_decode_mjpeg(reader_read_raw(reader), reader->decode_buffer, reader->frame_size, reader->width, reader->height);
-            return reader->decode_buffer;
-        case capture_format_NV12:
-            reader_decode_nv12(reader_read_raw(reader), reader->decode_buffer, reader->width, reader->height);
-            return reader->decode_buffer;
+// capture_mode_uring: every buffer nobody holds has a read in flight. Reads of released buffers are submitted with
+// the next read of a frame and completions are reaped from the shared ring, so a frame costs one io_uring_enter
+// instead of a read() that waits for the data.
+#define READER_URING_ENTRIES (2 * READER_MAX_BUFFERS)
+// user_data of cancellations, reads carry their buffer index
+#define READER_URING_CANCEL UINT64_MAX
+
+struct reader_uring {
+    int ring_fd;
+    // reader->fd, the ring signals every completion on it
+    int event_fd;
+    void* sq_ring;
+    size_t sq_ring_length;
+    void* cq_ring;
+    size_t cq_ring_length;
+    struct io_uring_sqe* sqes;
+    size_t sqes_length;
+    atomic_uint* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    atomic_uint* cq_head;
+    atomic_uint* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // SQEs written but not submitted yet, the kernel sees them when sq_tail is set to tail
+    unsigned pending;
+    unsigned tail;
+    // buffers with a read submitted or pending, buffers whose read completed but was not handed out yet
+    uint64_t in_flight;
+    uint64_t completed;
+    int results[READER_MAX_BUFFERS];
+    // order buffers are handed out in: regular files by offset, everything else as the reads completed
+    int order[READER_MAX_BUFFERS];
+    size_t order_head;
+    size_t order_tail;
+    // regular files are read at explicit offsets, so the reads in flight do not depend on each other
+    bool seekable;
+    off_t offset;
+    off_t offsets[READER_MAX_BUFFERS];
+    // the file or stream ended, reads report ENODATA until the stream is restarted
+    bool end;
+};
+
+// Next free SQE, submitted with the next reader_uring_enter. The ring has room for a read and a cancellation of
+// every buffer.
+struct io_uring_sqe* reader_uring_sqe(struct reader_uring* uring) {
+    unsigned slot = uring->tail++ & uring->sq_mask;
+    struct io_uring_sqe* sqe = &uring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[slot] = slot;
+    uring->pending++;
+    return sqe;
+}
+
+// Submit the pending SQEs and wait for at least wait completions
+int reader_uring_enter(struct reader_uring* uring, unsigned wait) {
+    atomic_store_explicit(uring->sq_tail, uring->tail, memory_order_release);
+    int submitted = syscall(__NR_io_uring_enter, uring->ring_fd, uring->pending, wait,
+                            wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted == -1) {
+        return -1;
     }
-    return NULL;
+    uring->pending -= submitted;
+    return 0;
 }
 
-void reader_postprocess(struct frame_reader* reader) {
-    (void) reader;
+// Start a read into buffer index, files continue where the previous read ended
+void reader_uring_queue(struct frame_reader* reader, size_t index) {
+    struct reader_uring* uring = reader->source_data;
+    struct io_uring_sqe* sqe = reader_uring_sqe(uring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reader->device_fd;
+    sqe->addr = (uintptr_t)reader->capture_buffers[index].ptr;
+    sqe->len = reader->frame_size;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = index;
+    if (uring->seekable) {
+        sqe->off = uring->offset;
+        uring->offsets[index] = uring->offset;
+        uring->offset += reader->frame_size;
+        uring->order[uring->order_tail++ % READER_MAX_BUFFERS] = index;
+    }
+    uring->in_flight |= (uint64_t)1 << index;
 }
 
-void reader_stop(struct frame_reader* reader) {
-    switch (reader->capture_mode) {
-        case capture_mode_read:
-            return;
-        case capture_mode_mmap:
-            // dequeue last used buffer
-            struct v4l2_buffer buf = {0};
-            if (reader->capture_buffers_current_index != -1) {
-                buf.index = reader->capture_buffers_current_index;
-                if (-1 == ioctl(reader->fd, VIDIOC_QBUF, &buf)) {
-                    // TODO error handling
-                }
-                reader->capture_buffers_current_index = -1;
-            }
+// Collect every completion in the ring
+void reader_uring_reap(struct reader_uring* uring) {
+    unsigned head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(uring->cq_tail, memory_order_acquire);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe* cqe = &uring->cqes[head & uring->cq_mask];
+        if (cqe->user_data == READER_URING_CANCEL) {
+            continue;
+        }
+        size_t index = cqe->user_data;
+        uring->results[index] = cqe->res;
+        uring->in_flight &= ~((uint64_t)1 << index);
+        uring->completed |= (uint64_t)1 << index;
+        if (!uring->seekable) {
+            uring->order[uring->order_tail++ % READER_MAX_BUFFERS] = index;
+        }
+    }
+    atomic_store_explicit(uring->cq_head, head, memory_order_release);
+}
 
-            // stop capturing
-            enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            int streamoff_status = ioctl(reader->fd, VIDIOC_STREAMOFF, &type);
-            // TODO error handling
-            (void) streamoff_status;
-            break;
+// The buffer handed out next, -1 if its read did not complete yet
+int reader_uring_next(struct reader_uring* uring) {
+    if (uring->order_head == uring->order_tail) {
+        return -1;
     }
+    int index = uring->order[uring->order_head % READER_MAX_BUFFERS];
+    return (uring->completed & ((uint64_t)1 << index)) ? index : -1;
 }
 
-void reader_destroy(struct frame_reader* reader) {
+// Keep reader->fd readable, e.g. while completed reads are left after a frame was handed out
+void reader_uring_signal(struct reader_uring* uring) {
+    uint64_t one = 1;
+    (void)!write(uring->event_fd, &one, sizeof(one));
+}
 
-    switch (reader->fmt) {
-        case capture_format_RGB24:
-            break;
-        case capture_format_YUYV:
-        case capture_format_MJPEG:
-            free(reader->decode_buffer);
-            break;
+// Set up the ring and its eventfd (reader->fd) on the first open, they are kept when the buffers are made again
+int reader_uring_open(struct frame_reader* reader) {
+    struct stat st;
+    if (reader->frame_size <= 0 || -1 == fstat(reader->device_fd, &st)) {
+        errno = EINVAL;
+        return -1;
+    }
+    // compressed frames vary in size, a file of them can not be cut into reads
+    if (S_ISREG(st.st_mode) && reader->fmt == capture_format_MJPEG) {
+        errno = ENOTSUP;
+        return -1;
     }
 
-    switch (reader->capture_mode) {
-        case capture_mode_read:
-            free(reader->capture_buffer);
-            break;
-        case capture_mode_mmap:
+    struct reader_uring* uring = reader->source_data;
+    // reads which could not be cancelled would complete into the new buffers
+    if (uring != NULL && uring->in_flight != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (uring == NULL) {
+        uring = calloc(1, sizeof(struct reader_uring));
+        uring->ring_fd = -1;
+        reader->source_data = uring;
+        uring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (uring->event_fd == -1) {
+            return -1;
+        }
 
-            // remove all buffers from the queue
-            for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
-                int status = munmap(reader->capture_buffers[i].ptr, reader->capture_buffers[i].length);
-                (void) status;
-                // TODO error handling
+        struct io_uring_params params = {0};
+        uring->ring_fd = syscall(__NR_io_uring_setup, READER_URING_ENTRIES, &params);
+        if (uring->ring_fd == -1) {
+            return -1;
+        }
+        uring->sq_ring_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        uring->cq_ring_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        uring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+        // both rings share one mapping on kernels with IORING_FEAT_SINGLE_MMAP
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (uring->cq_ring_length > uring->sq_ring_length) {
+                uring->sq_ring_length = uring->cq_ring_length;
+            }
+            uring->cq_ring_length = 0;
+        }
+        uring->sq_ring = mmap(NULL, uring->sq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              uring->ring_fd, IORING_OFF_SQ_RING);
+        if (MAP_FAILED == uring->sq_ring) {
+            uring->sq_ring = NULL;
+            return -1;
+        }
+        uring->cq_ring = uring->sq_ring;
+        if (uring->cq_ring_length > 0) {
+            uring->cq_ring = mmap(NULL, uring->cq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  uring->ring_fd, IORING_OFF_CQ_RING);
+            if (MAP_FAILED == uring->cq_ring) {
+                uring->cq_ring = NULL;
+                return -1;
             }
+        }
+        uring->sqes = mmap(NULL, uring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           uring->ring_fd, IORING_OFF_SQES);
+        if (MAP_FAILED == uring->sqes) {
+            uring->sqes = NULL;
+            return -1;
+        }
 
-            free(reader->capture_buffers);
-            break;
+        char* sq = uring->sq_ring;
+        char* cq = uring->cq_ring;
+        uring->sq_tail = (atomic_uint*)(sq + params.sq_off.tail);
+        uring->tail = atomic_load(uring->sq_tail);
+        uring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        uring->sq_array = (unsigned*)(sq + params.sq_off.array);
+        uring->cq_head = (atomic_uint*)(cq + params.cq_off.head);
+        uring->cq_tail = (atomic_uint*)(cq + params.cq_off.tail);
+        uring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        if (-1 == syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_EVENTFD, &uring->event_fd, 1)) {
+            return -1;
+        }
+        uring->seekable = S_ISREG(st.st_mode);
+        uring->offset = uring->seekable ? lseek(reader->device_fd, 0, SEEK_CUR) : 0;
     }
+    reader->fd = uring->event_fd;
 
-    free(reader);
+    reader->capture_buffers_length = reader->capture_buffers_requested;
+    reader->capture_buffers =
+        reader_userptr_pool_new(reader->capture_buffers_length, reader->frame_size, reader->alloc_flags);
+    if (reader->capture_buffers == NULL) {
+        reader->capture_buffers_length = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int reader_uring_start(struct frame_reader* reader) {
+    struct reader_uring* uring = reader->source_data;
+    uring->end = false;
+    // buffers consumers still hold when the watchdog restarts are read into once they are released
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        if (atomic_load(&reader->buffer_holds[i]) == 0) {
+            reader_uring_queue(reader, i);
+        }
+    }
+    return reader_uring_enter(uring, 0);
 }
 
+struct frame_reader_frame* reader_uring_read(struct frame_reader* reader) {
+    struct reader_uring* uring = reader->source_data;
+    if (uring->end) {
+        errno = ENODATA;
+        return NULL;
+    }
+    // the reads of buffers released since the last frame go in together
+    if (uring->pending > 0 && -1 == reader_uring_enter(uring, 0)) {
+        return NULL;
+    }
 
+    uint64_t value;
+    (void)!read(uring->event_fd, &value, sizeof(value));
+    reader_uring_reap(uring);
+
+    int index = reader_uring_next(uring);
+    if (index == -1) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    uring->order_head++;
+    uring->completed &= ~((uint64_t)1 << index);
+    if (reader_uring_next(uring) != -1) {
+        reader_uring_signal(uring);
+    }
+
+    int bytes = uring->results[index];
+    if (bytes < 0) {
+        reader_uring_queue(reader, index);
+        errno = -bytes;
+        return NULL;
+    }
+    // a file ends with its last whole frame, a stream when its writer went away. The fd stays readable so waiting
+    // consumers see the end.
+    if (bytes == 0 || (uring->seekable && bytes < reader->frame_size)) {
+        uring->end = true;
+        reader_uring_signal(uring);
+        errno = ENODATA;
+        return NULL;
+    }
+    // compressed frames vary in size, everything else has to be complete
+    if (reader->fmt != capture_format_MJPEG && bytes != reader->frame_size) {
+        reader_uring_queue(reader, index);
+        errno = EIO;
+        return NULL;
+    }
+
+    struct frame_reader_frame* frame = &reader->frames[index];
+    reader_stamp_read_frame(reader, frame, bytes);
+    return frame;
+}
+
+// The read into a released buffer goes in with the next read of a frame, unless no other read is in flight to wake
+// the consumer up for that
+int reader_uring_release(struct frame_reader* reader, size_t index) {
+    struct reader_uring* uring = reader->source_data;
+    reader_uring_queue(reader, index);
+    if ((unsigned)__builtin_popcountll(uring->in_flight) > uring->pending) {
+        return 0;
+    }
+    return reader_uring_enter(uring, 0);
+}
+
+// Cancel the reads in flight and wait until their buffers are back, reads of regular files finish on their own.
+// Completed reads which were not handed out are dropped, a file is read on from the first of them on the next start.
+int reader_uring_stop(struct frame_reader* reader) {
+    struct reader_uring* uring = reader->source_data;
+    uint64_t in_flight = uring->in_flight;
+    for (size_t i = 0; in_flight != 0; ++i, in_flight >>= 1) {
+        if (in_flight & 1) {
+            struct io_uring_sqe* sqe = reader_uring_sqe(uring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = i;
+            sqe->user_data = READER_URING_CANCEL;
+        }
+    }
+    while (uring->in_flight != 0) {
+        if (-1 == reader_uring_enter(uring, 1) && errno != EINTR) {
+            return -1;
+        }
+        reader_uring_reap(uring);
+    }
+
+    if (uring->seekable && uring->order_head != uring->order_tail) {
+        uring->offset = uring->offsets[uring->order[uring->order_head % READER_MAX_BUFFERS]];
+    }
+    uring->order_head = 0;
+    uring->order_tail = 0;
+    uring->completed = 0;
+    uint64_t value;
+    (void)!read(uring->event_fd, &value, sizeof(value));
+    return 0;
+}
+
+// Returns -1 if reads may still be in flight, their buffers are leaked then instead of being freed under the kernel
+int reader_uring_free_buffers(struct frame_reader* reader) {
+    if (reader->source_data == NULL) {
+        return 0;
+    }
+    if (-1 == reader_uring_stop(reader)) {
+        return -1;
+    }
+    reader_userptr_pool_free(reader->capture_buffers, reader->capture_buffers_length);
+    return 0;
+}
+
+// The device fd is owned by the caller and stays open
+void reader_uring_close(struct frame_reader* reader) {
+    struct reader_uring* uring = reader->source_data;
+    if (uring == NULL) {
+        return;
+    }
+    reader_uring_free_buffers(reader);
+    if (uring->sqes != NULL) {
+        munmap(uring->sqes, uring->sqes_length);
+    }
+    if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_length);
+    }
+    if (uring->sq_ring != NULL) {
+        munmap(uring->sq_ring, uring->sq_ring_length);
+    }
+    if (uring->ring_fd >= 0) {
+        close(uring->ring_fd);
+    }
+    if (uring->event_fd >= 0) {
+        close(uring->event_fd);
+    }
+    free(uring);
+    reader->source_data = NULL;
+    reader->fd = reader->device_fd;
+}
+
+// Subscribe to the READER_EVENT_* in events, to control events for every control of the device. Subscribing again
+// is harmless, so a device which was reconfigured or reopened is simply subscribed again.
+void reader_v4l2_subscribe_events(struct frame_reader* reader, unsigned events) {
+    struct v4l2_event_subscription subscription = {0};
+    if (events & READER_EVENT_SOURCE_CHANGE) {
+        subscription.type = V4L2_EVENT_SOURCE_CHANGE;
+        ioctl(reader->device_fd, VIDIOC_SUBSCRIBE_EVENT, &subscription);
+    }
+    if (events & READER_EVENT_EOS) {
+        subscription.type = V4L2_EVENT_EOS;
+        ioctl(reader->device_fd, VIDIOC_SUBSCRIBE_EVENT, &subscription);
+    }
+    if (events & READER_EVENT_CTRL) {
+        struct v4l2_queryctrl query = {.id = V4L2_CTRL_FLAG_NEXT_CTRL};
+        while (0 == ioctl(reader->device_fd, VIDIOC_QUERYCTRL, &query)) {
+            if (!(query.flags & V4L2_CTRL_FLAG_DISABLED) && query.type != V4L2_CTRL_TYPE_CTRL_CLASS) {
+                subscription = (struct v4l2_event_subscription){.type = V4L2_EVENT_CTRL, .id = query.id};
+                ioctl(reader->device_fd, VIDIOC_SUBSCRIBE_EVENT, &subscription);
+            }
+            query.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+        }
+    }
+}
+
+int reader_v4l2_open(struct frame_reader* fr, const struct frame_reader_options* options, const void* source_options) {
+    const struct frame_source_v4l2_options* v4l2_options = source_options;
+    fr->fd = v4l2_options->fd;
+    fr->device_fd = v4l2_options->fd;
+    fr->capture_mode = v4l2_options->mode;
+    fr->buf_type = reader_v4l2_buf_type(fr->device_fd, fr->fmt);
+    fr->buffer_planes_length = 1;
+
+    // multi-planar formats are split into their planes the driver set up with S_FMT
+    size_t plane_sizes[VIDEO_MAX_PLANES] = {fr->frame_size};
+    if (fr->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        struct v4l2_format format = {0};
+        format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        if (-1 == ioctl(fr->device_fd, VIDIOC_G_FMT, &format) || format.fmt.pix_mp.num_planes == 0 ||
+            format.fmt.pix_mp.num_planes > READER_MAX_PLANES) {
+            return -1;
+        }
+        fr->buffer_planes_length = format.fmt.pix_mp.num_planes;
+        for (size_t p = 0; p < fr->buffer_planes_length; ++p) {
+            plane_sizes[p] = format.fmt.pix_mp.plane_fmt[p].sizeimage;
+        }
+    }
+
+    switch (fr->capture_mode) {
+        case capture_mode_read:
+            // read() returns all planes back to back
+            if (-1 == reader_buffer_alloc(&fr->read_allocation, fr->frame_size, fr->alloc_flags)) {
+                return -1;
+            }
+            fr->capture_buffer = fr->read_allocation.ptr;
+            fr->capture_buffers_length = 1;
+            fr->buffer_planes_length = 1;
+            break;
+
+        case capture_mode_uring:
+            // like read(), one buffer holds all planes
+            fr->buffer_planes_length = 1;
+            if (-1 == reader_uring_open(fr)) {
+                return -1;
+            }
+            break;
+
+        case capture_mode_mmap:
+            struct v4l2_requestbuffers requestbuffers = {0};
+            requestbuffers.type = fr->buf_type;
+            requestbuffers.memory = V4L2_MEMORY_MMAP;
+            requestbuffers.count = fr->capture_buffers_requested;
+            if (-1 == ioctl(fr->device_fd, VIDIOC_REQBUFS, &requestbuffers) || requestbuffers.count == 0) {
+                return -1;
+            }
+
+            // the driver is free to grant more or less buffers than requested, we use whatever it gave us
+            fr->capture_buffers_length = requestbuffers.count;
+            if (fr->capture_buffers_length > READER_MAX_BUFFERS) {
+                fr->capture_buffers_length = READER_MAX_BUFFERS;
+            }
+            fr->capture_buffers =
+                calloc(fr->capture_buffers_length * fr->buffer_planes_length, sizeof(struct frame_reader_buffers));
+
+            for (size_t i = 0; i < fr->capture_buffers_length; ++i) {
+                struct v4l2_buffer buf;
+                struct v4l2_plane planes[VIDEO_MAX_PLANES];
+                reader_v4l2_buffer(fr, &buf, planes, i);
+
+                bool mapped = -1 != ioctl(fr->device_fd, VIDIOC_QUERYBUF, &buf);
+                for (size_t p = 0; mapped && p < fr->buffer_planes_length; ++p) {
+                    bool multiplanar = fr->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+                    size_t length = multiplanar ? planes[p].length : buf.length;
+                    off_t offset = multiplanar ? planes[p].m.mem_offset : buf.m.offset;
+                    void* ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fr->device_fd, offset);
+                    if (MAP_FAILED == ptr) {
+                        mapped = false;
+                        break;
+                    }
+                    fr->capture_buffers[i * fr->buffer_planes_length + p].ptr = ptr;
+                    fr->capture_buffers[i * fr->buffer_planes_length + p].length = length;
+                }
+
+                if (!mapped) {
+                    // only unmap what was mapped so far, the planes of buffer i are unmapped by their NULL ptr
+                    fr->capture_buffers_length = i + 1;
+                    return -1;
+                }
+            }
+            break;
+
+        case capture_mode_userptr:
+            if (options == NULL || options->userptr_buffers == NULL || options->userptr_buffers_length == 0) {
+                return -1;
+            }
+            for (size_t i = 0; i < options->userptr_buffers_length; ++i) {
+                if (options->userptr_buffers[i].length < (size_t)fr->frame_size) {
+                    return -1;
+                }
+            }
+
+            struct v4l2_requestbuffers userptr_requestbuffers = {0};
+            userptr_requestbuffers.type = fr->buf_type;
+            userptr_requestbuffers.memory = V4L2_MEMORY_USERPTR;
+            fr->capture_buffers_requested = options->userptr_buffers_length;
+            if (fr->capture_buffers_requested > READER_MAX_BUFFERS) {
+                fr->capture_buffers_requested = READER_MAX_BUFFERS;
+            }
+            userptr_requestbuffers.count = fr->capture_buffers_requested;
+            if (-1 == ioctl(fr->device_fd, VIDIOC_REQBUFS, &userptr_requestbuffers) || userptr_requestbuffers.count == 0) {
+                return -1;
+            }
+
+            // we can not use more buffers than the application handed us
+            fr->capture_buffers_length = userptr_requestbuffers.count;
+            if (fr->capture_buffers_length > fr->capture_buffers_requested) {
+                fr->capture_buffers_length = fr->capture_buffers_requested;
+            }
+            // the reader keeps its own table, the memory stays owned by the application. Planes are carved out of
+            // each application buffer back to back.
+            fr->capture_buffers =
+                calloc(fr->capture_buffers_length * fr->buffer_planes_length, sizeof(struct frame_reader_buffers));
+            for (size_t i = 0; i < fr->capture_buffers_length; ++i) {
+                size_t offset = 0;
+                for (size_t p = 0; p < fr->buffer_planes_length; ++p) {
+                    struct frame_reader_buffers* plane = &fr->capture_buffers[i * fr->buffer_planes_length + p];
+                    plane->ptr = (char*)options->userptr_buffers[i].ptr + offset;
+                    plane->length = fr->buffer_planes_length > 1 ? plane_sizes[p] : options->userptr_buffers[i].length;
+                    offset += plane_sizes[p];
+                }
+            }
+            break;
+    }
+
+    // the watchdog measures stalls in frame intervals
+    struct v4l2_streamparm parm = {0};
+    parm.type = fr->buf_type;
+    fr->frame_interval = 0;
+    if (0 == ioctl(fr->device_fd, VIDIOC_G_PARM, &parm) && parm.parm.capture.timeperframe.denominator > 0) {
+        fr->frame_interval = (int64_t)parm.parm.capture.timeperframe.numerator * 1000000 /
+                             parm.parm.capture.timeperframe.denominator;
+    }
+
+    reader_alloc_frames(fr);
+    for (size_t i = 0; i < fr->capture_buffers_length; ++i) {
+        struct frame_reader_frame* frame = &fr->frames[i];
+        if (fr->capture_mode == capture_mode_read) {
+            frame->ptr = fr->capture_buffer;
+            frame->length = fr->frame_size;
+            continue;
+        }
+        frame->ptr = fr->capture_buffers[i * fr->buffer_planes_length].ptr;
+        frame->length = 0;
+        for (size_t p = 0; p < fr->buffer_planes_length; ++p) {
+            frame->length += fr->capture_buffers[i * fr->buffer_planes_length + p].length;
+        }
+    }
+
+    if (options != NULL && options->export_dmabuf) {
+        // a frame carries a single DMABUF, multi-planar buffers would need one per plane
+        if (fr->capture_mode != capture_mode_mmap || fr->buffer_planes_length > 1) {
+            return -1;
+        }
+        for (size_t i = 0; i < fr->capture_buffers_length; ++i) {
+            struct v4l2_exportbuffer expbuf = {0};
+            expbuf.type = fr->buf_type;
+            expbuf.index = i;
+            expbuf.flags = O_RDONLY | O_CLOEXEC;
+            if (-1 == ioctl(fr->device_fd, VIDIOC_EXPBUF, &expbuf)) {
+                return -1;
+            }
+            fr->frames[i].dmabuf_fd = expbuf.fd;
+        }
+    }
+
+    // events come with POLLPRI on reader->fd, which is not the device in uring mode
+    if (options != NULL && options->events != 0 && fr->capture_mode != capture_mode_uring) {
+        reader_v4l2_subscribe_events(fr, options->events);
+    }
+
+    return 0;
+}
+
+int reader_v4l2_start(struct frame_reader* reader) {
+    switch (reader->capture_mode) {
+        case capture_mode_read:
+            return 0;
+        case capture_mode_uring:
+            return reader_uring_start(reader);
+        case capture_mode_mmap:
+        case capture_mode_userptr:
+            // but all the buffers in the queue, except the ones consumers still hold when the watchdog restarts
+            for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+                if (atomic_load(&reader->buffer_holds[i]) == 0) {
+                    reader_queue_buffer(reader, i);
+                }
+            }
+            // start capturing
+            enum v4l2_buf_type type = reader->buf_type;
+            return ioctl(reader->device_fd, VIDIOC_STREAMON, &type);
+    }
+    return 0;
+}
+
+struct frame_reader_frame* reader_v4l2_read(struct frame_reader* reader) {
+    switch (reader->capture_mode) {
+        case capture_mode_read:
+            int bytes = read(reader->device_fd, reader->capture_buffer, reader->frame_size);
+            if (bytes == -1) {
+                return NULL;
+            }
+
+            // the end of a file of raw frames
+            if (bytes == 0) {
+                errno = ENODATA;
+                return NULL;
+            }
+            // compressed frames vary in size, everything else has to be complete
+            if (reader->fmt != capture_format_MJPEG && bytes != reader->frame_size) {
+                errno = EIO;
+                return NULL;
+            }
+
+            reader_stamp_read_frame(reader, &reader->frames[0], bytes);
+            return &reader->frames[0];
+        case capture_mode_uring:
+            return reader_uring_read(reader);
+        case capture_mode_mmap:
+        case capture_mode_userptr:
+            struct v4l2_buffer buf;
+            struct v4l2_plane planes[VIDEO_MAX_PLANES];
+            reader_v4l2_buffer(reader, &buf, planes, 0);
+
+            // dequeue buffer
+            if (-1 == ioctl(reader->device_fd, VIDIOC_DQBUF, &buf)) {
+                return NULL;
+            }
+            reader_account_frame(reader, buf.sequence, buf.flags);
+
+            struct frame_reader_frame* frame = &reader->frames[buf.index];
+            frame->sequence = buf.sequence;
+            frame->flags = buf.flags;
+            frame->timestamp = buf.timestamp;
+            if (reader->buf_type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                frame->bytesused = buf.bytesused;
+                return frame;
+            }
+
+            // the payload of a plane starts data_offset bytes into its buffer
+            struct frame_reader_buffers* buffers = &reader->capture_buffers[buf.index * reader->buffer_planes_length];
+            frame->bytesused = 0;
+            frame->planes_length = reader->buffer_planes_length;
+            for (size_t p = 0; p < reader->buffer_planes_length; ++p) {
+                size_t offset = planes[p].data_offset < planes[p].bytesused ? planes[p].data_offset : 0;
+                frame->planes[p].ptr = (char*)buffers[p].ptr + offset;
+                frame->planes[p].length = buffers[p].length - offset;
+                frame->planes[p].bytesused = planes[p].bytesused - offset;
+                frame->bytesused += frame->planes[p].bytesused;
+            }
+            frame->ptr = frame->planes[0].ptr;
+            return frame;
+    }
+    return NULL;
+}
+
+int reader_v4l2_release(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    if (reader->capture_mode == capture_mode_read) {
+        return 0;
+    }
+    if (reader->capture_mode == capture_mode_uring) {
+        return reader_uring_release(reader, frame->index);
+    }
+    return reader_queue_buffer(reader, frame->index);
+}
+
+int reader_v4l2_stop(struct frame_reader* reader) {
+    if (reader->capture_mode == capture_mode_read) {
+        return 0;
+    }
+    if (reader->capture_mode == capture_mode_uring) {
+        return reader_uring_stop(reader);
+    }
+    // stop capturing, this also takes back all queued buffers
+    enum v4l2_buf_type type = reader->buf_type;
+    return ioctl(reader->device_fd, VIDIOC_STREAMOFF, &type);
+}
+
+// The device fd is owned by the caller and stays open
+void reader_v4l2_close(struct frame_reader* reader) {
+    if (reader->frames != NULL) {
+        for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+            if (reader->frames[i].dmabuf_fd >= 0) {
+                close(reader->frames[i].dmabuf_fd);
+            }
+        }
+    }
+
+    switch (reader->capture_mode) {
+        case capture_mode_read:
+            reader_buffer_free(&reader->read_allocation);
+            break;
+        case capture_mode_uring:
+            reader_uring_close(reader);
+            break;
+        case capture_mode_mmap:
+
+            // remove all buffers from the queue
+            for (size_t i = 0; i < reader->capture_buffers_length * reader->buffer_planes_length; ++i) {
+                if (reader->capture_buffers[i].ptr == NULL) {
+                    continue;
+                }
+                int status = munmap(reader->capture_buffers[i].ptr, reader->capture_buffers[i].length);
+                (void) status;
+                // TODO error handling
+            }
+
+            [[fallthrough]];
+        case capture_mode_userptr:
+            // userptr memory belongs to the application, only our copy of the table is freed
+            free(reader->capture_buffers);
+
+            // release the driver side buffers
+            struct v4l2_requestbuffers requestbuffers = {0};
+            requestbuffers.type = reader->buf_type;
+            requestbuffers.memory = reader_memory(reader);
+            requestbuffers.count = 0;
+            ioctl(reader->device_fd, VIDIOC_REQBUFS, &requestbuffers);
+            break;
+    }
+}
+
+uint32_t reader_v4l2_pixfmt(enum supported_capture_format fmt) {
+    switch (fmt) {
+        case capture_format_RGB24:
+            return V4L2_PIX_FMT_RGB24;
+        case capture_format_YUYV:
+            return V4L2_PIX_FMT_YUYV;
+        case capture_format_MJPEG:
+            return V4L2_PIX_FMT_MJPEG;
+        case capture_format_NV12:
+            return V4L2_PIX_FMT_NV12;
+        case capture_format_YVU420M:
+            return V4L2_PIX_FMT_YVU420M;
+    }
+    return 0;
+}
+
+// The reader's format for a V4L2 pixel format, -1 if the reader can not decode it
+int reader_capture_format(uint32_t pixfmt) {
+    switch (pixfmt) {
+        case V4L2_PIX_FMT_RGB24:
+            return capture_format_RGB24;
+        case V4L2_PIX_FMT_YUYV:
+            return capture_format_YUYV;
+        case V4L2_PIX_FMT_MJPEG:
+            return capture_format_MJPEG;
+        case V4L2_PIX_FMT_NV12:
+            return capture_format_NV12;
+        case V4L2_PIX_FMT_YVU420M:
+            return capture_format_YVU420M;
+    }
+    return -1;
+}
+
+// S_FMT for a device without buffers, the reader takes the size the driver granted. The frame rate is kept, S_FMT
+// may reset it.
+int reader_v4l2_set_format(struct frame_reader* reader, enum supported_capture_format fmt, int width, int height) {
+    enum v4l2_buf_type type = reader_v4l2_buf_type(reader->device_fd, fmt);
+
+    struct v4l2_streamparm parm = {0};
+    parm.type = type;
+    bool keep_rate = 0 == ioctl(reader->device_fd, VIDIOC_G_PARM, &parm) &&
+                     (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME);
+
+    struct v4l2_format format = {0};
+    format.type = type;
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        format.fmt.pix_mp.width = width;
+        format.fmt.pix_mp.height = height;
+        format.fmt.pix_mp.pixelformat = reader_v4l2_pixfmt(fmt);
+        format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        format.fmt.pix_mp.colorspace = V4L2_COLORSPACE_SRGB;
+    } else {
+        format.fmt.pix.width = width;
+        format.fmt.pix.height = height;
+        format.fmt.pix.pixelformat = reader_v4l2_pixfmt(fmt);
+        format.fmt.pix.field = V4L2_FIELD_NONE;
+        format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+    }
+    if (-1 == ioctl(reader->device_fd, VIDIOC_S_FMT, &format)) {
+        return -1;
+    }
+
+    reader->fmt = fmt;
+    reader->buf_type = type;
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        reader->width = format.fmt.pix_mp.width;
+        reader->height = format.fmt.pix_mp.height;
+        reader->frame_size = 0;
+        for (size_t p = 0; p < format.fmt.pix_mp.num_planes && p < VIDEO_MAX_PLANES; ++p) {
+            reader->frame_size += format.fmt.pix_mp.plane_fmt[p].sizeimage;
+        }
+    } else {
+        reader->width = format.fmt.pix.width;
+        reader->height = format.fmt.pix.height;
+        reader->frame_size = format.fmt.pix.sizeimage;
+    }
+
+    if (keep_rate) {
+        ioctl(reader->device_fd, VIDIOC_S_PARM, &parm);
+    }
+    return 0;
+}
+
+// Give every buffer back to the driver, the format of a device can only change without buffers. Returns -1 if reads
+// of the ring could not be stopped, the reader has no buffers either way.
+int reader_v4l2_free_buffers(struct frame_reader* reader) {
+    int status = 0;
+    if (reader->capture_mode == capture_mode_uring) {
+        // the ring and its eventfd stay, reader->fd keeps its number
+        status = reader_uring_free_buffers(reader);
+    } else {
+        reader_v4l2_close(reader);
+    }
+    reader->capture_buffers = NULL;
+    reader->capture_buffers_length = 0;
+    free(reader->frames);
+    free(reader->handles);
+    reader->frames = NULL;
+    reader->handles = NULL;
+    return status;
+}
+
+// The format the device delivers after a source change, it has to be stopped. Receivers with DV timings (HDMI, SDI)
+// only detect the new timings, the format follows once they are set.
+int reader_v4l2_source_format(struct frame_reader* reader, enum supported_capture_format* fmt, int* width,
+                              int* height) {
+    struct v4l2_dv_timings timings = {0};
+    if (0 == ioctl(reader->device_fd, VIDIOC_QUERY_DV_TIMINGS, &timings) &&
+        -1 == ioctl(reader->device_fd, VIDIOC_S_DV_TIMINGS, &timings)) {
+        return -1;
+    }
+
+    struct v4l2_format format = {0};
+    format.type = reader->buf_type;
+    if (-1 == ioctl(reader->device_fd, VIDIOC_G_FMT, &format)) {
+        return -1;
+    }
+    bool multiplanar = format.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    uint32_t pixfmt = multiplanar ? format.fmt.pix_mp.pixelformat : format.fmt.pix.pixelformat;
+    int capture_format = reader_capture_format(pixfmt);
+    if (capture_format == -1) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    *fmt = capture_format;
+    *width = multiplanar ? format.fmt.pix_mp.width : format.fmt.pix.width;
+    *height = multiplanar ? format.fmt.pix_mp.height : format.fmt.pix.height;
+    return 0;
+}
+
+// The buffers are made again for the new frame size. If that fails the old format is restored, if that fails too the
+// reader has no buffers and errno is EIO.
+int reader_v4l2_reconfigure(struct frame_reader* reader, enum supported_capture_format fmt, int width, int height) {
+    struct frame_source_v4l2_options v4l2_options = {.fd = reader->device_fd, .mode = reader->capture_mode};
+    enum supported_capture_format old_fmt = reader->fmt;
+    int old_width = reader->width;
+    int old_height = reader->height;
+
+    // files of raw frames (read and uring mode) have no format to switch
+    struct v4l2_capability caps = {0};
+    if (-1 == ioctl(reader->device_fd, VIDIOC_QUERYCAP, &caps)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (-1 == reader_v4l2_free_buffers(reader)) {
+        return -1;
+    }
+    if (0 == reader_v4l2_set_format(reader, fmt, width, height) &&
+        0 == reader_v4l2_open(reader, &reader->options, &v4l2_options)) {
+        return 0;
+    }
+
+    int error = errno;
+    if (-1 == reader_v4l2_free_buffers(reader) ||
+        -1 == reader_v4l2_set_format(reader, old_fmt, old_width, old_height) ||
+        -1 == reader_v4l2_open(reader, &reader->options, &v4l2_options)) {
+        // not even the old format is left
+        reader_v4l2_free_buffers(reader);
+        errno = EIO;
+        return -1;
+    }
+    errno = error;
+    return -1;
+}
+
+// The device node is back after the device went away, e.g. on a USB reset. It is opened onto the number of the old
+// fd, so the caller's fd and everyone polling it stay valid, and set up with the old format again.
+int reader_v4l2_reopen(struct frame_reader* reader) {
+    if (reader->options.device_path == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    int fd = open(reader->options.device_path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (-1 == reader_v4l2_free_buffers(reader)) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    int status = dup2(fd, reader->device_fd);
+    close(fd);
+    if (status == -1) {
+        return -1;
+    }
+
+    struct frame_source_v4l2_options v4l2_options = {.fd = reader->device_fd, .mode = reader->capture_mode};
+    if (-1 == reader_v4l2_set_format(reader, reader->fmt, reader->width, reader->height)) {
+        return -1;
+    }
+    return reader_v4l2_open(reader, &reader->options, &v4l2_options);
+}
+
+const struct frame_source frame_source_v4l2 = {
+    .name = "v4l2",
+    .open = reader_v4l2_open,
+    .start = reader_v4l2_start,
+    .read = reader_v4l2_read,
+    .release = reader_v4l2_release,
+    .stop = reader_v4l2_stop,
+    .close = reader_v4l2_close,
+    .reconfigure = reader_v4l2_reconfigure,
+    .reopen = reader_v4l2_reopen,
+    .source_format = reader_v4l2_source_format,
+};
+
+// Borrow the decode buffer for the reader's format and resolution from the pool, the one of an earlier
+// configuration goes back first so a switch to the same size gets the same block again
+int reader_alloc_decode_buffer(struct frame_reader* fr) {
+    reader_pool_free(fr->decode_buffer);
+    fr->decode_buffer = NULL;
+
+    switch (fr->fmt) {
+        case capture_format_RGB24:
+            fr->texture_format = GL_RGB;
+            break;
+        case capture_format_YUYV:
+        case capture_format_MJPEG:
+        case capture_format_NV12:
+        case capture_format_YVU420M:
+            fr->texture_format = GL_RGB;
+            fr->decode_buffer = reader_pool_alloc((size_t)fr->width * fr->height * 3, fr->alloc_flags);
+            if (fr->decode_buffer == NULL) {
+                return -1;
+            }
+            fr->decode_buffer_flags = reader_pool_flags(fr->decode_buffer);
+            break;
+    }
+    return 0;
+}
+
+// Create a reader for any source. The source may replace fmt, width, height and frame_size, e.g. with the values
+// stored in a recording.
+struct frame_reader* reader_new_source(const struct frame_source* source, const void* source_options,
+                                       enum supported_capture_format fmt, int width, int height, int frame_size,
+                                       const struct frame_reader_options* options) {
+    struct frame_reader* fr = calloc(1, sizeof(struct frame_reader));
+    fr->fd = -1;
+    fr->device_fd = -1;
+    fr->source = source;
+
+    fr->fmt = fmt;
+    fr->width = width;
+    fr->height = height;
+    fr->frame_size = frame_size;
+
+    fr->wake_fd = -1;
+    fr->ready_fd = -1;
+    pthread_mutex_init(&fr->events_lock, NULL);
+
+    fr->policy = options != NULL ? options->policy : reader_policy_default;
+    fr->capture_buffers_requested = reader_policy_buffers(fr->policy);
+    if (options != NULL && options->capture_buffers_length > 0) {
+        fr->capture_buffers_requested = options->capture_buffers_length;
+    }
+    fr->handoff = options != NULL ? options->handoff : reader_handoff_ring;
+    fr->alloc_flags = options != NULL ? options->alloc_flags : 0;
+    if (options != NULL) {
+        fr->options = *options;
+    }
+    if (fr->handoff == reader_handoff_mailbox && fr->capture_buffers_requested < READER_MAILBOX_BUFFERS) {
+        fr->capture_buffers_requested = READER_MAILBOX_BUFFERS;
+    }
+    if (options != NULL && fr->capture_buffers_requested < options->pinned_handles + 2) {
+        fr->capture_buffers_requested = options->pinned_handles + 2;
+    }
+    if (fr->capture_buffers_requested > READER_MAX_BUFFERS) {
+        fr->capture_buffers_requested = READER_MAX_BUFFERS;
+    }
+
+    if (-1 == source->open(fr, options, source_options) || -1 == reader_alloc_decode_buffer(fr)) {
+        reader_destroy(fr);
+        return NULL;
+    }
+
+    return fr;
+}
+
+struct frame_reader* reader_new_with_options(int fd, enum supported_capture_mode mode, enum supported_capture_format fmt,
+                                             int width, int height, int frame_size,
+                                             const struct frame_reader_options* options) {
+    struct frame_source_v4l2_options v4l2_options = {.fd = fd, .mode = mode};
+    return reader_new_source(&frame_source_v4l2, &v4l2_options, fmt, width, height, frame_size, options);
+}
+
+struct frame_reader* reader_new(int fd, enum supported_capture_mode mode, enum supported_capture_format fmt, int width, int height, int frame_size) {
+    return reader_new_with_options(fd, mode, fmt, width, height, frame_size, NULL);
+}
+
+// Start streaming, returns -1 if the source could not start
+int reader_start(struct frame_reader* reader) {
+
+    // sequence numbers restart with every stream
+    reader->last_sequence_valid = false;
+    reader->last_frame_time = reader_monotonic_us();
+    reader->recovery_time = 0;
+    atomic_store(&reader->end_of_stream, false);
+
+    // stopping took every buffer back, handles from before are gone
+    atomic_store(&reader->released, 0);
+    atomic_store(&reader->buffers_pinned, 0);
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        atomic_store(&reader->buffer_holds[i], 0);
+        atomic_store(&reader->handles[i].refs, 0);
+    }
+
+    return reader->source->start(reader);
+}
+
+
+enum frame_reader_result {
+    reader_result_frame,
+    // nothing new since the last read, no stale data is handed out
+    reader_result_no_frame,
+    reader_result_error,
+    // the source has no more frames, e.g. a replay without loop reached the end of the recording
+    reader_result_end,
+};
+
+// Queue an event for reader_next_event, the oldest one is dropped if nobody takes them
+void reader_push_event(struct frame_reader* reader, const struct frame_reader_event* event) {
+    pthread_mutex_lock(&reader->events_lock);
+    if (reader->events_tail - reader->events_head == READER_MAX_EVENTS) {
+        reader->events_head++;
+        atomic_fetch_add_explicit(&reader->events_dropped, 1, memory_order_relaxed);
+    }
+    reader->events[reader->events_tail++ % READER_MAX_EVENTS] = *event;
+    pthread_mutex_unlock(&reader->events_lock);
+}
+
+// Take the oldest event of the device (see options.events), safe from any thread. Returns 1 if there was one and 0
+// if not.
+int reader_next_event(struct frame_reader* reader, struct frame_reader_event* event) {
+    pthread_mutex_lock(&reader->events_lock);
+    bool available = reader->events_head != reader->events_tail;
+    if (available) {
+        *event = reader->events[reader->events_head++ % READER_MAX_EVENTS];
+    }
+    pthread_mutex_unlock(&reader->events_lock);
+    return available ? 1 : 0;
+}
+
+// Take the events the device signalled with POLLPRI, only called by the owner of the source. A source change is
+// only noted, the consumer follows it with reader_apply_source_change. Returns the number of events taken.
+int reader_take_events(struct frame_reader* reader) {
+    int count = 0;
+    struct v4l2_event v4l2_event = {0};
+    while (0 == ioctl(reader->device_fd, VIDIOC_DQEVENT, &v4l2_event)) {
+        count++;
+        atomic_fetch_add_explicit(&reader->events_received, 1, memory_order_relaxed);
+
+        struct frame_reader_event event = {.sequence = v4l2_event.sequence, .timestamp = v4l2_event.timestamp};
+        switch (v4l2_event.type) {
+            case V4L2_EVENT_SOURCE_CHANGE:
+                // changes in a row are followed once, nothing is dequeued until then
+                reader->source_change.changes |= v4l2_event.u.src_change.changes;
+                reader->source_change.sequence = v4l2_event.sequence;
+                reader->source_change.timestamp = v4l2_event.timestamp;
+                atomic_store(&reader->source_change_pending, true);
+                break;
+            case V4L2_EVENT_EOS:
+                event.type = reader_event_eos;
+                atomic_store(&reader->end_of_stream, true);
+                reader_push_event(reader, &event);
+                break;
+            case V4L2_EVENT_CTRL:
+                event.type = reader_event_ctrl;
+                event.changes = v4l2_event.u.ctrl.changes;
+                event.ctrl_id = v4l2_event.id;
+                event.value = v4l2_event.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64 ? v4l2_event.u.ctrl.value64
+                                                                                 : v4l2_event.u.ctrl.value;
+                reader_push_event(reader, &event);
+                break;
+        }
+        v4l2_event = (struct v4l2_event){0};
+    }
+    return count;
+}
+
+// Wait up to timeout milliseconds (-1 waits forever) for a frame. Events of the device are taken right away.
+// Returns 1 if a frame or an event (see reader_next_event) is ready, 0 on timeout and -1 on error.
+int reader_wait(struct frame_reader* reader, int timeout) {
+    struct pollfd pfd = {.fd = reader->fd, .events = POLLIN | POLLPRI};
+    int status = poll(&pfd, 1, timeout);
+    if (status == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (status == 0) {
+        return 0;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        errno = EIO;
+        return -1;
+    }
+    bool events = (pfd.revents & POLLPRI) && reader_take_events(reader) > 0;
+    return (pfd.revents & POLLIN) || events ? 1 : 0;
+}
+
+// Give a buffer back to the source
+int reader_release_buffer(struct frame_reader* reader, size_t index) {
+    int status = reader->source->release(reader, &reader->frames[index]);
+    if (status == -1) {
+        atomic_fetch_add_explicit(&reader->requeue_failures, 1, memory_order_relaxed);
+    }
+    return status;
+}
+
+// Give back a frame the reader dequeued but never handed out. Its hold goes first, so a failed requeue leaves a
+// buffer nobody holds and a restart of the stream queues it again.
+int reader_requeue_frame(struct frame_reader* reader, size_t index) {
+    atomic_store(&reader->buffer_holds[index], 0);
+    return reader_release_buffer(reader, index);
+}
+
+// Drop a hold on a buffer, the last one hands it to the owner of the source for requeueing. Safe from any thread.
+void reader_buffer_put(struct frame_reader* reader, size_t index) {
+    if (atomic_fetch_sub(&reader->buffer_holds[index], 1) != 1) {
+        return;
+    }
+    atomic_fetch_or(&reader->released, (uint64_t)1 << index);
+    if (reader->wake_fd != -1) {
+        uint64_t one = 1;
+        (void)!write(reader->wake_fd, &one, sizeof(one));
+    }
+}
+
+// Give released buffers back to the source, only called by the owner of the source. Returns the number of buffers
+// requeued.
+size_t reader_requeue_released(struct frame_reader* reader) {
+    size_t requeued = 0;
+    uint64_t released = atomic_exchange(&reader->released, 0);
+    for (size_t i = 0; released != 0; ++i, released >>= 1) {
+        if ((released & 1) && reader_release_buffer(reader, i) != -1) {
+            requeued++;
+        }
+    }
+    return requeued;
+}
+
+// Give the frames handed out by the last read or drain back to the source, unless they were acquired
+int reader_release_current(struct frame_reader* reader) {
+    uint64_t current = reader->capture_buffers_current;
+    for (size_t i = 0; current != 0; ++i, current >>= 1) {
+        if (current & 1) {
+            reader_buffer_put(reader, i);
+        }
+    }
+    reader->capture_buffers_current = 0;
+    reader_requeue_released(reader);
+    return 0;
+}
+
+// Count a frame taken from the driver, called by whoever dequeues
+void reader_account_frame(struct frame_reader* reader, uint32_t sequence, uint32_t flags) {
+    atomic_fetch_add_explicit(&reader->frames_dequeued, 1, memory_order_relaxed);
+    if (flags & V4L2_BUF_FLAG_ERROR) {
+        atomic_fetch_add_explicit(&reader->error_frames, 1, memory_order_relaxed);
+    }
+    if (reader->last_sequence_valid) {
+        // unsigned arithmetic handles the wrap around, a jump backwards means the counter was reset
+        uint32_t gap = sequence - reader->last_sequence - 1;
+        if (gap > 0 && gap < UINT32_MAX / 2) {
+            atomic_fetch_add_explicit(&reader->driver_drops, gap, memory_order_relaxed);
+        }
+    }
+    reader->last_sequence = sequence;
+    reader->last_sequence_valid = true;
+}
+
+// Point the planes of frame at its single buffer, planar formats are laid out back to back in it
+void reader_frame_split_planes(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    size_t luma = (size_t)reader->width * reader->height;
+    if (reader->fmt == capture_format_YVU420M && frame->bytesused >= luma * 3 / 2) {
+        frame->planes_length = 3;
+        frame->planes[0] = (struct frame_reader_plane){frame->ptr, luma, luma};
+        frame->planes[1] = (struct frame_reader_plane){(char*)frame->ptr + luma, luma / 4, luma / 4};
+        frame->planes[2] = (struct frame_reader_plane){(char*)frame->ptr + luma * 5 / 4, luma / 4, luma / 4};
+        return;
+    }
+    frame->planes_length = 1;
+    frame->planes[0] = (struct frame_reader_plane){frame->ptr, frame->length, frame->bytesused};
+}
+
+// Take the next frame from the source without waiting, errno is EAGAIN if there is none
+struct frame_reader_frame* reader_dequeue_frame(struct frame_reader* reader) {
+    // the watchdog failed to bring a device back, it tries again later
+    if (reader->frames == NULL) {
+        errno = ENODEV;
+        return NULL;
+    }
+    // frames in the old format are not handed out any more
+    if (atomic_load(&reader->source_change_pending)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    struct frame_reader_frame* frame = reader->source->read(reader);
+    if (frame == NULL && errno == EAGAIN && atomic_load(&reader->end_of_stream)) {
+        errno = ENODATA;
+    }
+    if (frame != NULL) {
+        reader->last_frame_time = reader_monotonic_us();
+        // multi-planar V4L2 buffers come with their planes
+        if (reader->buffer_planes_length <= 1) {
+            reader_frame_split_planes(reader, frame);
+        }
+        atomic_store(&reader->buffer_holds[frame->index], 1);
+    }
+    return frame;
+}
+
+// Like reader_dequeue_frame but skips ahead to the newest ready frame, older ones go straight back to the source.
+// Only called by the owner of the source.
+struct frame_reader_frame* reader_dequeue_newest(struct frame_reader* reader) {
+    struct frame_reader_frame* frame = reader_dequeue_frame(reader);
+    if (frame == NULL) {
+        return NULL;
+    }
+    // a device cannot have more frames ready than it has buffers, sources that are always ready stop there too. The
+    // read buffer is refilled in place, there is nothing to skip to.
+    for (size_t i = 1; i < reader->capture_buffers_length && reader_wait(reader, 0) == 1; ++i) {
+        struct frame_reader_frame* newer = reader_dequeue_frame(reader);
+        if (newer == NULL) {
+            break;
+        }
+        atomic_fetch_add_explicit(&reader->frames_skipped, 1, memory_order_relaxed);
+        reader_requeue_frame(reader, frame->index);
+        frame = newer;
+    }
+    return frame;
+}
+
+// Dequeue according to the policy
+struct frame_reader_frame* reader_dequeue_next(struct frame_reader* reader) {
+    if (reader->policy == reader_policy_lowest_latency) {
+        return reader_dequeue_newest(reader);
+    }
+    return reader_dequeue_frame(reader);
+}
+
+#define READER_WATCHDOG_DEFAULT_INTERVAL 33333
+
+// How long the watchdog lets a stream go without a frame in microseconds, 0 if it is disabled
+int64_t reader_watchdog_period(struct frame_reader* reader) {
+    int64_t interval = reader->frame_interval > 0 ? reader->frame_interval : READER_WATCHDOG_DEFAULT_INTERVAL;
+    return reader->options.watchdog_intervals * interval;
+}
+
+// Milliseconds until the watchdog wants to look at the stream again, for poll timeouts. -1 if it is disabled.
+int reader_watchdog_timeout(struct frame_reader* reader) {
+    int64_t period = reader_watchdog_period(reader);
+    if (period == 0) {
+        return -1;
+    }
+    int64_t remaining = reader->last_frame_time + period - reader_monotonic_us();
+    return remaining > 0 ? (remaining + 999) / 1000 : 0;
+}
+
+// Stop and start the stream again, buffers consumers hold stay with them and are requeued when they are released
+int reader_restart_stream(struct frame_reader* reader) {
+    if (-1 == reader->source->stop(reader)) {
+        return -1;
+    }
+    atomic_store(&reader->released, 0);
+    reader->last_sequence_valid = false;
+    return reader->source->start(reader);
+}
+
+// Reopening replaces every buffer, it has to wait until consumers released theirs
+int reader_reopen_device(struct frame_reader* reader) {
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        if (atomic_load(&reader->buffer_holds[i]) > 0) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    reader->source->stop(reader);
+    if (-1 == reader->source->reopen(reader)) {
+        return -1;
+    }
+    atomic_store(&reader->released, 0);
+    atomic_store(&reader->buffers_pinned, 0);
+    reader->capture_buffers_current = 0;
+    reader->last_sequence_valid = false;
+    return reader->source->start(reader);
+}
+
+// Called by the owner of the source when a read brought no frame, error is its errno or 0 if nothing was ready.
+// Without a watchdog errors are passed on. With it EINTR is ignored, and a stream which failed or stalled for
+// watchdog_intervals frame intervals is restarted, or its device reopened if that does not help. Recovery is tried
+// at most once per watchdog period. Returns 0 if reading can go on, 1 if the error persists until the next attempt
+// (reader_watchdog_timeout) and -1 with errno if it can not be recovered.
+int reader_watchdog(struct frame_reader* reader, int error) {
+    if (error == EAGAIN || error == EINTR) {
+        error = 0;
+    }
+    int64_t period = reader_watchdog_period(reader);
+    // the end of a stream is no failure
+    if (error == ENODATA || (period == 0 && error != 0)) {
+        errno = error;
+        return -1;
+    }
+    if (period == 0) {
+        return 0;
+    }
+
+    int64_t now = reader_monotonic_us();
+    if (error == 0 && now - reader->last_frame_time < period) {
+        return 0;
+    }
+    if (error != 0 && reader->recovery_time != 0 && now - reader->recovery_time < period) {
+        return 1;
+    }
+    atomic_fetch_add_explicit(error == 0 ? &reader->stalls : &reader->device_errors, 1, memory_order_relaxed);
+    reader->last_frame_time = now;
+    if (error != 0) {
+        reader->recovery_time = now;
+    }
+
+    bool recovered = false;
+    if (error != ENODEV && reader->frames != NULL && 0 == reader_restart_stream(reader)) {
+        atomic_fetch_add_explicit(&reader->stream_restarts, 1, memory_order_relaxed);
+        recovered = true;
+    } else if (reader->source->reopen != NULL && 0 == reader_reopen_device(reader)) {
+        atomic_fetch_add_explicit(&reader->device_reopens, 1, memory_order_relaxed);
+        recovered = true;
+    }
+
+    if (!recovered) {
+        int reason = errno;
+        if (reason != EBUSY) {
+            atomic_fetch_add_explicit(&reader->recovery_failures, 1, memory_order_relaxed);
+        }
+        // a restart alone is all the source can do, or the device can not be reopened at all
+        if (reader->source->reopen == NULL || reason == ENOTSUP) {
+            errno = error != 0 ? error : ETIMEDOUT;
+            return -1;
+        }
+        return 1;
+    }
+
+    // the capture thread counts the buffers in the driver
+    reader->queued = 0;
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        if (atomic_load(&reader->buffer_holds[i]) == 0) {
+            reader->queued++;
+        }
+    }
+    return 0;
+}
+
+int reader_apply_source_change(struct frame_reader* reader);
+
+// Blocking read, the frame stays valid until the next read
+struct frame_reader_frame* reader_read_frame(struct frame_reader* reader) {
+    // queue last used buffer if one was in use
+    if (-1 == reader_release_current(reader)) {
+        // TODO error handling
+        return NULL;
+    }
+
+    struct frame_reader_frame* frame = NULL;
+    while (frame == NULL) {
+        // with a watchdog the wait ends when the stream stalled
+        int ready = reader_wait(reader, reader_watchdog_timeout(reader));
+        if (-1 == reader_apply_source_change(reader)) {
+            return NULL;
+        }
+        if (ready == 1) {
+            frame = reader_dequeue_next(reader);
+        }
+        if (frame == NULL) {
+            int status = reader_watchdog(reader, ready == 0 ? 0 : errno);
+            if (status == -1) {
+                return NULL;
+            }
+            if (status == 1) {
+                // the fd keeps failing until the device is back, wait for the next attempt instead of spinning
+                poll(NULL, 0, reader_watchdog_timeout(reader));
+            }
+        }
+    }
+    reader->capture_buffers_current = (uint64_t)1 << frame->index;
+    return frame;
+}
+
+// Non-blocking read, never waits for the device. A frame is only handed out once, the previous frame is released
+// even if there is no new one.
+enum frame_reader_result reader_try_read_frame(struct frame_reader* reader, struct frame_reader_frame** frame) {
+    *frame = NULL;
+
+    if (-1 == reader_release_current(reader)) {
+        return reader_result_error;
+    }
+
+    int ready = reader_wait(reader, 0);
+    if (-1 == reader_apply_source_change(reader)) {
+        return reader_result_error;
+    }
+    if (ready != 1) {
+        return -1 == reader_watchdog(reader, ready == 0 ? 0 : errno) ? reader_result_error : reader_result_no_frame;
+    }
+
+    *frame = reader_dequeue_next(reader);
+    if (*frame == NULL) {
+        if (errno == ENODATA) {
+            return reader_result_end;
+        }
+        return -1 == reader_watchdog(reader, errno) ? reader_result_error : reader_result_no_frame;
+    }
+    reader->capture_buffers_current = (uint64_t)1 << (*frame)->index;
+    return reader_result_frame;
+}
+
+// What reader_drain hands out
+enum frame_reader_drain {
+    // every ready frame, oldest first
+    reader_drain_batch,
+    // only the newest ready frame, the older ones go straight back to the source and count as skipped
+    reader_drain_newest,
+};
+
+// Non-blocking, takes every frame that is ready in one go so a consumer which fell behind catches up in one step.
+// Frames are stored in frames (at most frames_length, in batch mode also at most one less than the source has buffers
+// so it never runs dry) and stay valid until the next read or drain. Like reader_try_read_frame the previous frames
+// are released first. Returns the number of frames, 0 if none was ready or -1 on error, errno is ENODATA at the end of
+// a stream.
+int reader_drain(struct frame_reader* reader, enum frame_reader_drain mode, struct frame_reader_frame** frames,
+                 size_t frames_length) {
+    if (-1 == reader_release_current(reader) || -1 == reader_apply_source_change(reader)) {
+        return -1;
+    }
+
+    // read mode refills its single buffer in place
+    size_t limit = mode == reader_drain_newest ? 1 : frames_length;
+    size_t available = reader->capture_buffers_length > 1 ? reader->capture_buffers_length - 1 : 1;
+    if (limit > available) {
+        limit = available;
+    }
+
+    size_t count = 0;
+    while (count < limit) {
+        int ready = reader_wait(reader, 0);
+        if (ready == -1) {
+            break;
+        }
+        if (ready == 0) {
+            errno = EAGAIN;
+            break;
+        }
+        struct frame_reader_frame* frame =
+            mode == reader_drain_newest ? reader_dequeue_newest(reader) : reader_dequeue_frame(reader);
+        if (frame == NULL) {
+            break;
+        }
+        reader->capture_buffers_current |= (uint64_t)1 << frame->index;
+        frames[count++] = frame;
+    }
+
+    // what is already taken is handed out, an error shows up again on the next call
+    if (count == 0 && -1 == reader_watchdog(reader, errno)) {
+        return -1;
+    }
+    return count;
+}
+
+void* reader_read_raw(struct frame_reader* reader) {
+    struct frame_reader_frame* frame = reader_read_frame(reader);
+    return frame != NULL ? frame->ptr : NULL;
+}
+
+// Snapshot of the counters, safe to call while a capture thread is running
+struct frame_reader_stats reader_stats(struct frame_reader* reader) {
+    struct frame_reader_stats stats = {0};
+    stats.frames = atomic_load_explicit(&reader->frames_dequeued, memory_order_relaxed);
+    stats.driver_drops = atomic_load_explicit(&reader->driver_drops, memory_order_relaxed);
+    stats.frames_skipped = atomic_load_explicit(&reader->frames_skipped, memory_order_relaxed);
+    stats.ring_overflows = atomic_load_explicit(&reader->ring_overflows, memory_order_relaxed);
+    stats.frames_superseded = atomic_load_explicit(&reader->frames_superseded, memory_order_relaxed);
+    stats.consumer_drops = stats.frames_skipped + stats.ring_overflows + stats.frames_superseded;
+    stats.error_frames = atomic_load_explicit(&reader->error_frames, memory_order_relaxed);
+    stats.frames_copied = atomic_load_explicit(&reader->frames_copied, memory_order_relaxed);
+    stats.requeue_failures = atomic_load_explicit(&reader->requeue_failures, memory_order_relaxed);
+    stats.stalls = atomic_load_explicit(&reader->stalls, memory_order_relaxed);
+    stats.device_errors = atomic_load_explicit(&reader->device_errors, memory_order_relaxed);
+    stats.stream_restarts = atomic_load_explicit(&reader->stream_restarts, memory_order_relaxed);
+    stats.device_reopens = atomic_load_explicit(&reader->device_reopens, memory_order_relaxed);
+    stats.recovery_failures = atomic_load_explicit(&reader->recovery_failures, memory_order_relaxed);
+    stats.events = atomic_load_explicit(&reader->events_received, memory_order_relaxed);
+    stats.events_dropped = atomic_load_explicit(&reader->events_dropped, memory_order_relaxed);
+    stats.source_changes = atomic_load_explicit(&reader->source_changes, memory_order_relaxed);
+    stats.source_change_failures = atomic_load_explicit(&reader->source_change_failures, memory_order_relaxed);
+    stats.capture_affinity = atomic_load_explicit(&reader->capture_affinity, memory_order_relaxed);
+    stats.capture_scheduling = atomic_load_explicit(&reader->capture_scheduling, memory_order_relaxed);
+    stats.decode_affinity = atomic_load_explicit(&reader->decode_affinity, memory_order_relaxed);
+    return stats;
+}
+
+// Keep a frame beyond the next read, e.g. to hand it to other threads. frame has to be the frame of the last
+// read or a frame popped from the capture thread and not released yet. Every consumer takes its own reference
+// with reader_frame_ref and drops it with reader_frame_unref, the buffer is requeued after the last one.
+// If pinning the buffer would leave the source with less than one buffer besides the one the consumer reads
+// next, the data is copied instead and the buffer is not held back (see frame_reader_stats.frames_copied). With the
+// default two buffers every handle is a copy, options.pinned_handles adds buffers for frames to be shared in place.
+// All handles have to be released before reader_stop.
+struct frame_reader_handle* reader_frame_acquire(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    struct frame_reader_handle* handle = &reader->handles[frame->index];
+    // share an existing handle, unless its last reference is being dropped right now
+    unsigned refs = atomic_load(&handle->refs);
+    while (refs > 0 && !atomic_compare_exchange_weak(&handle->refs, &refs, refs + 1)) {
+    }
+    if (refs > 0) {
+        return handle;
+    }
+
+    if (atomic_load(&reader->buffers_pinned) + 2 < reader->capture_buffers_length) {
+        handle->frame = *frame;
+        handle->copied = false;
+        atomic_fetch_add(&reader->buffers_pinned, 1);
+        atomic_fetch_add(&reader->buffer_holds[frame->index], 1);
+        atomic_store(&handle->refs, 1);
+        return handle;
+    }
+
+    size_t size = 0;
+    for (size_t p = 0; p < frame->planes_length; ++p) {
+        size += frame->planes[p].bytesused > 0 ? frame->planes[p].bytesused : frame->planes[p].length;
+    }
+    struct frame_reader_handle* copy = reader_pool_alloc(sizeof(struct frame_reader_handle) + size, 0);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->frame = *frame;
+    copy->frame.ptr = copy + 1;
+    copy->frame.length = size;
+    copy->frame.dmabuf_fd = -1;
+    copy->reader = reader;
+    copy->copied = true;
+    atomic_init(&copy->refs, 1);
+    // the planes of the copy follow each other
+    char* data = copy->frame.ptr;
+    for (size_t p = 0; p < frame->planes_length; ++p) {
+        size_t plane_size = frame->planes[p].bytesused > 0 ? frame->planes[p].bytesused : frame->planes[p].length;
+        memcpy(data, frame->planes[p].ptr, plane_size);
+        copy->frame.planes[p].ptr = data;
+        copy->frame.planes[p].length = plane_size;
+        data += plane_size;
+    }
+    atomic_fetch_add_explicit(&reader->frames_copied, 1, memory_order_relaxed);
+    return copy;
+}
+
+// Take another reference, the caller has to hold one already
+struct frame_reader_handle* reader_frame_ref(struct frame_reader_handle* handle) {
+    atomic_fetch_add(&handle->refs, 1);
+    return handle;
+}
+
+// Drop a reference, safe from any thread
+void reader_frame_unref(struct frame_reader_handle* handle) {
+    if (atomic_fetch_sub(&handle->refs, 1) != 1) {
+        return;
+    }
+    if (handle->copied) {
+        reader_pool_free(handle);
+        return;
+    }
+    struct frame_reader* reader = handle->reader;
+    atomic_fetch_sub(&reader->buffers_pinned, 1);
+    reader_buffer_put(reader, handle->frame.index);
+}
+
+// Pipeline points at which the age of a frame is measured
+enum frame_reader_stage {
+    reader_stage_dequeue,
+    reader_stage_decode,
+    reader_stage_upload,
+    reader_stage_swap,
+    reader_stage_count,
+};
+
+// Log-linear buckets: values below READER_LATENCY_LINEAR get one bucket each, every power of two above is split
+// into READER_LATENCY_SUB_BUCKETS buckets (~12% resolution)
+#define READER_LATENCY_LINEAR 16
+#define READER_LATENCY_SUB_BUCKETS 8
+#define READER_LATENCY_BUCKETS (READER_LATENCY_LINEAR + (64 - 4) * READER_LATENCY_SUB_BUCKETS)
+
+struct frame_reader_latency_histogram {
+    uint64_t buckets[READER_LATENCY_BUCKETS];
+    uint64_t count;
+    // microseconds
+    uint64_t max;
+};
+
+struct frame_reader_latency {
+    struct frame_reader_latency_histogram stages[reader_stage_count];
+};
+
+// Microseconds since the driver stamped the frame, -1 if its timestamp is not from CLOCK_MONOTONIC
+int64_t reader_frame_age(const struct frame_reader_frame* frame) {
+    if ((frame->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        return -1;
+    }
+    int64_t age = reader_monotonic_us() - ((int64_t)frame->timestamp.tv_sec * 1000000 + frame->timestamp.tv_usec);
+    return age < 0 ? 0 : age;
+}
+
+size_t reader_latency_bucket(uint64_t value) {
+    if (value < READER_LATENCY_LINEAR) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    size_t sub_bucket = (value >> (exponent - 3)) & (READER_LATENCY_SUB_BUCKETS - 1);
+    return READER_LATENCY_LINEAR + (exponent - 4) * READER_LATENCY_SUB_BUCKETS + sub_bucket;
+}
+
+// Largest value which falls into bucket
+uint64_t reader_latency_bucket_limit(size_t bucket) {
+    if (bucket < READER_LATENCY_LINEAR) {
+        return bucket;
+    }
+    int exponent = (bucket - READER_LATENCY_LINEAR) / READER_LATENCY_SUB_BUCKETS + 4;
+    uint64_t sub_bucket = (bucket - READER_LATENCY_LINEAR) % READER_LATENCY_SUB_BUCKETS;
+    return ((uint64_t)1 << exponent) + ((sub_bucket + 1) << (exponent - 3)) - 1;
+}
+
+void reader_latency_add(struct frame_reader_latency_histogram* histogram, uint64_t value) {
+    histogram->buckets[reader_latency_bucket(value)]++;
+    histogram->count++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+// Record how old frame is at stage, frames without a monotonic timestamp are ignored
+void reader_latency_record(struct frame_reader_latency* latency, enum frame_reader_stage stage,
+                           const struct frame_reader_frame* frame) {
+    int64_t age = reader_frame_age(frame);
+    if (age >= 0) {
+        reader_latency_add(&latency->stages[stage], age);
+    }
+}
+
+// Upper bound of the percentile (0-100) in microseconds, never more than the recorded maximum
+uint64_t reader_latency_percentile(const struct frame_reader_latency_histogram* histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = histogram->count * percentile / 100.0;
+    if (rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < READER_LATENCY_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            uint64_t limit = reader_latency_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+const char* reader_stage_name(enum frame_reader_stage stage) {
+    switch (stage) {
+        case reader_stage_dequeue:
+            return "dequeue";
+        case reader_stage_decode:
+            return "decode";
+        case reader_stage_upload:
+            return "upload";
+        case reader_stage_swap:
+            return "swap";
+        case reader_stage_count:
+            break;
+    }
+    return "unknown";
+}
+
+// Called for every new frame, frame is NULL if the reader failed. The frame stays valid until the callback returns.
+typedef void (*frame_reader_callback)(struct frame_reader* reader, struct frame_reader_frame* frame, void* user_data);
+
+struct frame_reader_loop_entry {
+    struct frame_reader* reader;
+    frame_reader_callback callback;
+    void* user_data;
+    bool removed;
+    // device_reopens of the reader when its fd was registered, a reopened device has to be registered again
+    uint64_t reopens;
+};
+
+#define READER_LOOP_MAX_EVENTS 16
+
+// Drives many readers from a single thread, one epoll set for all capture fds
+struct frame_reader_loop {
+    int epoll_fd;
+    bool running;
+    bool dispatching;
+    struct frame_reader_loop_entry** entries;
+    size_t entries_length;
+};
+
+struct frame_reader_loop* reader_loop_new() {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        return NULL;
+    }
+    struct frame_reader_loop* loop = calloc(1, sizeof(struct frame_reader_loop));
+    loop->epoll_fd = epoll_fd;
+    return loop;
+}
+
+int reader_loop_add(struct frame_reader_loop* loop, struct frame_reader* reader, frame_reader_callback callback,
+                    void* user_data) {
+    struct frame_reader_loop_entry* entry = calloc(1, sizeof(struct frame_reader_loop_entry));
+    entry->reader = reader;
+    entry->callback = callback;
+    entry->user_data = user_data;
+    entry->reopens = atomic_load(&reader->device_reopens);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLPRI, .data.ptr = entry};
+    if (-1 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, reader->fd, &event)) {
+        free(entry);
+        return -1;
+    }
+
+    loop->entries = realloc(loop->entries, (loop->entries_length + 1) * sizeof(struct frame_reader_loop_entry*));
+    loop->entries[loop->entries_length++] = entry;
+    return 0;
+}
+
+// Drop the entries removed while dispatching, their events might still have been pending in the same batch
+void reader_loop_collect(struct frame_reader_loop* loop) {
+    size_t wrt_ptr = 0;
+    for (size_t i = 0; i < loop->entries_length; ++i) {
+        if (loop->entries[i]->removed) {
+            free(loop->entries[i]);
+        } else {
+            loop->entries[wrt_ptr++] = loop->entries[i];
+        }
+    }
+    loop->entries_length = wrt_ptr;
+}
+
+// Safe to call from within a callback
+int reader_loop_remove(struct frame_reader_loop* loop, struct frame_reader* reader) {
+    for (size_t i = 0; i < loop->entries_length; ++i) {
+        if (loop->entries[i]->reader == reader && !loop->entries[i]->removed) {
+            loop->entries[i]->removed = true;
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, reader->fd, NULL);
+            if (!loop->dispatching) {
+                reader_loop_collect(loop);
+            }
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+// Wait up to timeout milliseconds (-1 waits forever) and call the callbacks of all readers with a new frame.
+// Returns the number of callbacks called or -1 on error.
+int reader_loop_run_once(struct frame_reader_loop* loop, int timeout) {
+    struct epoll_event events[READER_LOOP_MAX_EVENTS];
+    int ready = epoll_wait(loop->epoll_fd, events, READER_LOOP_MAX_EVENTS, timeout);
+    if (ready == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int dispatched = 0;
+    loop->dispatching = true;
+    for (int i = 0; i < ready; ++i) {
+        struct frame_reader_loop_entry* entry = events[i].data.ptr;
+        if (entry->removed) {
+            continue;
+        }
+
+        struct frame_reader_frame* frame = NULL;
+        switch (reader_try_read_frame(entry->reader, &frame)) {
+            case reader_result_frame:
+            case reader_result_error:
+            case reader_result_end:
+                entry->callback(entry->reader, frame, entry->user_data);
+                dispatched++;
+                break;
+            case reader_result_no_frame:
+                break;
+        }
+    }
+
+    // readers without events may have stalled, or their device is gone and with it the registration of the fd.
+    // After a wakeup one clock read decides for all readers, only those past their deadline get the watchdog.
+    bool timed_out = ready == 0;
+    int64_t now = timed_out ? 0 : reader_monotonic_us();
+    for (size_t i = 0; i < loop->entries_length; ++i) {
+        struct frame_reader_loop_entry* entry = loop->entries[i];
+        if (entry->removed || entry->reader->options.watchdog_intervals == 0) {
+            continue;
+        }
+        bool due = timed_out || now - entry->reader->last_frame_time >= reader_watchdog_period(entry->reader);
+        if (due && -1 == reader_watchdog(entry->reader, 0)) {
+            entry->callback(entry->reader, NULL, entry->user_data);
+            dispatched++;
+        }
+        uint64_t reopens = atomic_load(&entry->reader->device_reopens);
+        if (entry->reopens != reopens) {
+            struct epoll_event event = {.events = EPOLLIN | EPOLLPRI, .data.ptr = entry};
+            if (0 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, entry->reader->fd, &event) || errno == EEXIST) {
+                entry->reopens = reopens;
+            }
+        }
+    }
+    loop->dispatching = false;
+    reader_loop_collect(loop);
+
+    return dispatched;
+}
+
+// Until the next watchdog check of any reader, -1 if none has a watchdog
+int reader_loop_timeout(struct frame_reader_loop* loop) {
+    int timeout = -1;
+    for (size_t i = 0; i < loop->entries_length; ++i) {
+        int reader_timeout = reader_watchdog_timeout(loop->entries[i]->reader);
+        if (reader_timeout != -1 && (timeout == -1 || reader_timeout < timeout)) {
+            timeout = reader_timeout;
+        }
+    }
+    return timeout;
+}
+
+void reader_loop_run(struct frame_reader_loop* loop) {
+    loop->running = true;
+    while (loop->running && loop->entries_length > 0) {
+        if (-1 == reader_loop_run_once(loop, reader_loop_timeout(loop))) {
+            break;
+        }
+    }
+    loop->running = false;
+}
+
+// Makes reader_loop_run return after the current dispatch, to be called from a callback
+void reader_loop_stop(struct frame_reader_loop* loop) {
+    loop->running = false;
+}
+
+// The readers are not touched, they are still owned by the caller
+void reader_loop_destroy(struct frame_reader_loop* loop) {
+    for (size_t i = 0; i < loop->entries_length; ++i) {
+        free(loop->entries[i]);
+    }
+    free(loop->entries);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+void reader_cpus_set(struct frame_reader_cpus* cpus, int cpu) {
+    if (cpu >= 0 && cpu < READER_MAX_CPUS) {
+        cpus->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+    }
+}
+
+bool reader_cpus_empty(const struct frame_reader_cpus* cpus) {
+    for (size_t i = 0; i < READER_MAX_CPUS / 64; ++i) {
+        if (cpus->bits[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Pin the calling thread to cpus. The glibc wrappers for affinity need _GNU_SOURCE, the system call does not.
+enum frame_reader_setting reader_thread_affinity(const struct frame_reader_cpus* cpus) {
+    if (reader_cpus_empty(cpus)) {
+        return reader_setting_unused;
+    }
+    if (-1 == syscall(__NR_sched_setaffinity, 0, sizeof(cpus->bits), cpus->bits)) {
+        return reader_setting_failed;
+    }
+    return reader_setting_applied;
+}
+
+// Run the calling thread under SCHED_FIFO or SCHED_RR with priority
+enum frame_reader_setting reader_thread_scheduling(int policy, int priority) {
+    if (policy == SCHED_OTHER) {
+        return reader_setting_unused;
+    }
+    struct sched_param param = {.sched_priority = priority};
+    if (0 != pthread_setschedparam(pthread_self(), policy, &param)) {
+        return reader_setting_failed;
+    }
+    return reader_setting_applied;
+}
+
+// Give released buffers back to the driver, called on the capture thread
+void reader_thread_requeue_released(struct frame_reader* reader) {
+    reader->queued += reader_requeue_released(reader);
+}
+
+// Publish a frame to the consumer, called on the capture thread
+void reader_thread_publish(struct frame_reader* reader, int index) {
+    uint64_t one = 1;
+
+    if (reader->handoff == reader_handoff_mailbox) {
+        int superseded = atomic_exchange(&reader->mailbox, index);
+        if (superseded != -1) {
+            if (reader_requeue_frame(reader, superseded) != -1) {
+                reader->queued++;
+            }
+            atomic_fetch_add_explicit(&reader->frames_superseded, 1, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&reader->frames_published, 1, memory_order_relaxed);
+        (void)!write(reader->ready_fd, &one, sizeof(one));
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&reader->ring.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&reader->ring.tail, memory_order_acquire);
+
+    // never leave the driver without a buffer, a consumer holding on to everything else costs this frame
+    if (reader->queued == 0 || head - tail == READER_MAX_BUFFERS) {
+        if (reader_requeue_frame(reader, index) != -1) {
+            reader->queued++;
+        }
+        atomic_fetch_add_explicit(&reader->ring_overflows, 1, memory_order_relaxed);
+        return;
+    }
+
+    reader->ring.slots[head % READER_MAX_BUFFERS] = index;
+    atomic_store_explicit(&reader->ring.head, head + 1, memory_order_release);
+    atomic_fetch_add_explicit(&reader->frames_published, 1, memory_order_relaxed);
+
+    (void)!write(reader->ready_fd, &one, sizeof(one));
+}
+
+void* reader_capture_thread(void* arg) {
+    struct frame_reader* reader = arg;
+    // a setting which can not be applied leaves the thread running with the default
+    atomic_store(&reader->capture_affinity, reader_thread_affinity(&reader->options.capture_cpus));
+    atomic_store(&reader->capture_scheduling,
+                 reader_thread_scheduling(reader->options.capture_policy, reader->options.capture_priority));
+    struct pollfd pfds[2] = {
+        {.fd = reader->fd, .events = POLLIN | POLLPRI},
+        {.fd = reader->wake_fd, .events = POLLIN},
+    };
+    // the watchdog is waiting for the next recovery attempt
+    bool backoff = false;
+
+    while (!atomic_load(&reader->capture_thread_stop)) {
+        reader_thread_requeue_released(reader);
+
+        // without queued buffers the device fd reports an error instead of blocking, and while the watchdog waits
+        // for the device to come back it keeps failing. A source change waits for the consumer.
+        bool source_change = atomic_load(&reader->source_change_pending);
+        pfds[0].fd = reader->queued > 0 && !backoff && !source_change ? reader->fd : -1;
+        int ready = poll(pfds, 2, reader_watchdog_timeout(reader));
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            atomic_store(&reader->capture_thread_error, errno);
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t value;
+            (void)!read(reader->wake_fd, &value, sizeof(value));
+        }
+
+        if ((reader->queued == 0 && reader->frames != NULL) || source_change) {
+            // the consumer holds every buffer, the device can not deliver anything
+            reader->last_frame_time = reader_monotonic_us();
+            continue;
+        }
+
+        int error = 0;
+        if (pfds[0].fd != -1 && (pfds[0].revents & (POLLERR | POLLNVAL))) {
+            error = EIO;
+        }
+
+        if (error == 0 && (pfds[0].revents & POLLPRI) && reader_take_events(reader) > 0) {
+            // the consumer takes them with reader_next_event and follows a source change
+            uint64_t one = 1;
+            (void)!write(reader->ready_fd, &one, sizeof(one));
+            if (atomic_load(&reader->end_of_stream) && !(pfds[0].revents & POLLIN)) {
+                atomic_store(&reader->capture_thread_error, ENODATA);
+                break;
+            }
+            if (atomic_load(&reader->source_change_pending)) {
+                continue;
+            }
+        }
+
+        if (error == 0 && (pfds[0].revents & POLLIN)) {
+            struct frame_reader_frame* frame = reader_dequeue_next(reader);
+            if (frame == NULL) {
+                error = errno;
+            } else {
+                reader->queued--;
+                reader_thread_publish(reader, frame->index);
+                continue;
+            }
+        }
+
+        int status = reader_watchdog(reader, error);
+        if (status == -1) {
+            atomic_store(&reader->capture_thread_error, errno);
+            break;
+        }
+        backoff = status == 1;
+    }
+
+    // wake the consumer so it notices the thread is gone
+    uint64_t one = 1;
+    (void)!write(reader->ready_fd, &one, sizeof(one));
+    return NULL;
+}
+
+// Move dequeuing onto a dedicated thread, capture no longer waits for the consumer. Frames are handed over with
+// reader_thread_pop/reader_thread_release. Needs at least two buffers, reader_start has to be called first. The
+// thread pins and schedules itself as options.capture_cpus and capture_policy ask, see reader_stats.
+int reader_thread_start(struct frame_reader* reader) {
+    if (reader->capture_buffers_length < 2 || reader->capture_thread_running) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (-1 == reader_release_current(reader)) {
+        return -1;
+    }
+
+    reader->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    reader->ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reader->wake_fd == -1 || reader->ready_fd == -1) {
+        return -1;
+    }
+
+    atomic_store(&reader->ring.head, 0);
+    atomic_store(&reader->ring.tail, 0);
+    atomic_store(&reader->mailbox, -1);
+    atomic_store(&reader->released, 0);
+    atomic_store(&reader->capture_thread_stop, false);
+    atomic_store(&reader->capture_thread_error, 0);
+    reader->queued = reader->capture_buffers_length;
+
+    int status = pthread_create(&reader->capture_thread, NULL, reader_capture_thread, reader);
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    reader->capture_thread_running = true;
+    return 0;
+}
+
+// Whether reader_thread_pop would hand out a frame
+bool reader_thread_pending(struct frame_reader* reader) {
+    if (reader->handoff == reader_handoff_mailbox) {
+        return atomic_load(&reader->mailbox) != -1;
+    }
+    return atomic_load(&reader->ring.head) != atomic_load(&reader->ring.tail);
+}
+
+// Take the next frame or NULL if there is none, it has to be given back with reader_thread_release. With
+// reader_handoff_ring this is the oldest published frame, with reader_handoff_mailbox the newest one. Mailbox
+// consumers should release the previous frame before taking the next one.
+struct frame_reader_frame* reader_thread_pop(struct frame_reader* reader) {
+    if (-1 == reader_apply_source_change(reader)) {
+        return NULL;
+    }
+    if (reader->handoff == reader_handoff_mailbox) {
+        int index = atomic_exchange(&reader->mailbox, -1);
+        return index == -1 ? NULL : &reader->frames[index];
+    }
+
+    size_t tail = atomic_load_explicit(&reader->ring.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&reader->ring.head, memory_order_acquire);
+    if (tail == head) {
+        return NULL;
+    }
+    int index = reader->ring.slots[tail % READER_MAX_BUFFERS];
+    atomic_store_explicit(&reader->ring.tail, tail + 1, memory_order_release);
+    return &reader->frames[index];
+}
+
+// The consumer is done with a popped frame, the buffer is requeued unless it was acquired
+void reader_thread_release(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    reader_buffer_put(reader, frame->index);
+}
+
+// Wait up to timeout milliseconds (-1 waits forever) for a published frame.
+// Returns 1 if a frame is ready, 0 on timeout and -1 if the capture thread failed.
+int reader_thread_wait(struct frame_reader* reader, int timeout) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (true) {
+        // a source change the reader could not follow leaves it capturing the old format
+        if (-1 == reader_apply_source_change(reader) && !reader->capture_thread_running) {
+            return -1;
+        }
+        if (reader_thread_pending(reader)) {
+            return 1;
+        }
+        // the wake up may have come from the capture thread exiting
+        if (atomic_load(&reader->capture_thread_error) != 0) {
+            errno = atomic_load(&reader->capture_thread_error);
+            return -1;
+        }
+
+        int remaining = timeout;
+        if (timeout > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            remaining = elapsed < timeout ? timeout - elapsed : 0;
+        }
+
+        struct pollfd pfd = {.fd = reader->ready_fd, .events = POLLIN};
+        int status = poll(&pfd, 1, remaining);
+        if (status == -1) {
+            return errno == EINTR ? 0 : -1;
+        }
+        if (status == 0) {
+            return reader_thread_pending(reader) ? 1 : 0;
+        }
+        // the signal may belong to a frame which was popped already, then keep waiting
+        uint64_t value;
+        (void)!read(reader->ready_fd, &value, sizeof(value));
+    }
+}
+
+// Join the capture thread. Frames which were not released yet are reclaimed by reader_stop.
+void reader_thread_stop(struct frame_reader* reader) {
+    if (!reader->capture_thread_running) {
+        return;
+    }
+
+    atomic_store(&reader->capture_thread_stop, true);
+    uint64_t one = 1;
+    (void)!write(reader->wake_fd, &one, sizeof(one));
+    pthread_join(reader->capture_thread, NULL);
+    reader->capture_thread_running = false;
+
+    close(reader->wake_fd);
+    close(reader->ready_fd);
+    reader->wake_fd = -1;
+    reader->ready_fd = -1;
+}
+
+// Pin the calling thread to options.decode_cpus, called once by the thread which decodes the reader's frames.
+// Threads it starts later inherit the CPUs, e.g. a capture thread without capture_cpus. Returns -1 if pinning
+// failed, the thread keeps running where it was then.
+int reader_decode_thread_setup(struct frame_reader* reader) {
+    enum frame_reader_setting setting = reader_thread_affinity(&reader->options.decode_cpus);
+    atomic_store(&reader->decode_affinity, setting);
+    return setting == reader_setting_failed ? -1 : 0;
+}
+
+// What goes over the wire next to the DMABUF fd
+struct frame_reader_wire_frame {
+    uint32_t index;
+    uint32_t length;
+    uint32_t bytesused;
+    uint32_t sequence;
+    uint32_t flags;
+    int64_t timestamp_sec;
+    int64_t timestamp_usec;
+};
+
+// Pass a frame's DMABUF to another process over a unix socket (SCM_RIGHTS). The receiver gets its own fd to the same
+// buffer, the frame has to be kept (no further reads) until the receiver is done with it.
+int reader_send_frame(int sock, const struct frame_reader_frame* frame) {
+    if (frame->dmabuf_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct frame_reader_wire_frame wire = {
+        .index = frame->index,
+        .length = frame->length,
+        .bytesused = frame->bytesused,
+        .sequence = frame->sequence,
+        .flags = frame->flags,
+        .timestamp_sec = frame->timestamp.tv_sec,
+        .timestamp_usec = frame->timestamp.tv_usec,
+    };
+    struct iovec iov = {.iov_base = &wire, .iov_len = sizeof(wire)};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &frame->dmabuf_fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(wire) ? 0 : -1;
+}
+
+// Receive a frame sent with reader_send_frame. frame->ptr is NULL until reader_map_frame, the received dmabuf_fd is
+// owned by the caller and released with reader_unmap_frame.
+int reader_recv_frame(int sock, struct frame_reader_frame* frame) {
+    struct frame_reader_wire_frame wire = {0};
+    struct iovec iov = {.iov_base = &wire, .iov_len = sizeof(wire)};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(wire)) {
+        return -1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    memcpy(&frame->dmabuf_fd, CMSG_DATA(cmsg), sizeof(int));
+    frame->ptr = NULL;
+    frame->planes_length = 0;
+    frame->index = wire.index;
+    frame->length = wire.length;
+    frame->bytesused = wire.bytesused;
+    frame->sequence = wire.sequence;
+    frame->flags = wire.flags;
+    frame->timestamp.tv_sec = wire.timestamp_sec;
+    frame->timestamp.tv_usec = wire.timestamp_usec;
+    return 0;
+}
+
+// Map a received DMABUF for CPU access, consumers importing the fd (EGL, Vulkan, ...) do not need this
+void* reader_map_frame(struct frame_reader_frame* frame) {
+    void* ptr = mmap(NULL, frame->length, PROT_READ, MAP_SHARED, frame->dmabuf_fd, 0);
+    frame->ptr = ptr == MAP_FAILED ? NULL : ptr;
+    // only single planar buffers are exported
+    frame->planes_length = frame->ptr != NULL ? 1 : 0;
+    frame->planes[0] = (struct frame_reader_plane){frame->ptr, frame->length, frame->bytesused};
+    return frame->ptr;
+}
+
+void reader_unmap_frame(struct frame_reader_frame* frame) {
+    if (frame->ptr != NULL) {
+        munmap(frame->ptr, frame->length);
+        frame->ptr = NULL;
+    }
+    if (frame->dmabuf_fd >= 0) {
+        close(frame->dmabuf_fd);
+        frame->dmabuf_fd = -1;
+    }
+}
+
+#define cc(v) ((v < 0) ? 0 : (255 < v) ? 255 : v)
+
+void reader_decode_nv12(unsigned char* in, unsigned char* out, size_t width, size_t height) {
+
+    // https://learn.microsoft.com/en-gb/windows/win32/medfound/recommended-8-bit-yuv-formats-for-video-rendering#nv12
+    // https://fourcc.org/fccyvrgb.php
+    // https://gist.github.com/dmitriykovalev/980f4bcf68ac4667e89d4d989de21835
+    size_t i, j = 0;
+
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j++) {
+
+            int index = i * width + j;
+            int offset = height * width, I = i/2, J = j/2, W = width/2;
+
+            int y = in[index] - 16;
+            int u = in[offset + (I*W+J)*2] - 128;
+            int v = in[offset + (I*W+J)*2+1] - 128;
+
+            out[index * 3 + 2] = cc(1.164 * y + 2.018 * u);
+            out[index * 3 + 1] = cc(1.164 * y - 0.813 * v - 0.391 * u);
+            out[index * 3 + 0] = cc(1.164 * y + 1.596 * v);
+        }
+    }
+}
+
+void reader_decode_yvu420(unsigned char* y_plane, unsigned char* v_plane, unsigned char* u_plane, unsigned char* out,
+                          size_t width, size_t height) {
+
+    // https://fourcc.org/fccyvrgb.php, like NV12 but with separate chroma planes
+    size_t i, j = 0;
+
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j++) {
+
+            int index = i * width + j;
+            int chroma = (i / 2) * (width / 2) + j / 2;
+
+            int y = y_plane[index] - 16;
+            int u = u_plane[chroma] - 128;
+            int v = v_plane[chroma] - 128;
+
+            out[index * 3 + 2] = cc(1.164 * y + 2.018 * u);
+            out[index * 3 + 1] = cc(1.164 * y - 0.813 * v - 0.391 * u);
+            out[index * 3 + 0] = cc(1.164 * y + 1.596 * v);
+        }
+    }
+}
+
+void reader_decode_yuyv(unsigned char* in, unsigned char* out, size_t width, size_t height) {
+
+    // https://fourcc.org/fccyvrgb.php
+    size_t i, j = 0;
+    int index, y0, u, y1, v;
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j += 2) {
+            index = i * width + j;
+            y0 = in[index * 2 + 0];
+            u = in[index * 2 + 1];
+            y1 = in[index * 2 + 2];
+            v = in[index * 2 + 3];
+
+            out[index * 3 + 0] = cc(1.164*(y0 - 16) + 1.596*(v - 128));
+            out[index * 3 + 1] = cc(1.164*(y0 - 16) - 0.813*(v - 128) - 0.391*(u - 128));
+            out[index * 3 + 2] = cc(1.164*(y0 - 16) + 2.018*(u - 128));
+
+            out[index * 3 + 3] = cc(1.164*(y1 - 16) + 1.596*(v - 128));
+            out[index * 3 + 4] = cc(1.164*(y1 - 16) - 0.813*(v - 128) - 0.391*(u - 128));
+            out[index * 3 + 5] = cc(1.164*(y1 - 16) + 2.018*(u - 128));
+        }
+    }
+}
+
+bool reader_decode_mjpeg(unsigned char* in, unsigned char* out, size_t input_size, size_t width, size_t height) {
+
+    int w, h, n_channels;
+    unsigned char* image = stbi_load_from_memory(in, input_size, &w, &h, &n_channels, 3);
+
+    // corrupt or truncated frames happen, e.g. on USB bandwidth issues
+    if (image == NULL || (size_t)w != width || (size_t)h != height) {
+        stbi_image_free(image);
+        return false;
+    }
+
+    memcpy(out, image, width*height*3);
+
+    stbi_image_free(image);
+    return true;
+}
+
+
+// Decode a frame to RGB, the result stays valid until the next decode
+void* reader_decode_rgb(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    if (frame == NULL) {
+        return NULL;
+    }
+    enum supported_capture_format format = reader->fmt;
+    switch (format) {
+        case capture_format_RGB24:
+            return frame->ptr;
+        case capture_format_YUYV:
+            reader_decode_yuyv(frame->ptr, reader->decode_buffer, reader->width, reader->height);
+            return reader->decode_buffer;
+        case capture_format_MJPEG:
+            if (!reader_decode_mjpeg(frame->ptr, reader->decode_buffer, frame->bytesused, reader->width, reader->height)) {
+                return NULL;
+            }
+            return reader->decode_buffer;
+        case capture_format_NV12:
+            reader_decode_nv12(frame->ptr, reader->decode_buffer, reader->width, reader->height);
+            return reader->decode_buffer;
+        case capture_format_YVU420M:
+            // a truncated frame has a single plane
+            if (frame->planes_length != 3) {
+                return NULL;
+            }
+            reader_decode_yvu420(frame->planes[0].ptr, frame->planes[1].ptr, frame->planes[2].ptr,
+                                 reader->decode_buffer, reader->width, reader->height);
+            return reader->decode_buffer;
+    }
+    return NULL;
+}
+
+void* reader_read_decode_rgb(struct frame_reader* reader) {
+    return reader_decode_rgb(reader, reader_read_frame(reader));
+}
+
+void reader_postprocess(struct frame_reader* reader) {
+    (void) reader;
+}
+
+// Stop streaming, the source is stopped even if the last used buffer could not be queued. Returns -1 with the errno
+// of the first failure.
+int reader_stop(struct frame_reader* reader) {
+    reader_thread_stop(reader);
+
+    // queue last used buffer
+    int status = reader_release_current(reader);
+    int error = errno;
+
+    if (-1 == reader->source->stop(reader)) {
+        return -1;
+    }
+    errno = error;
+    return status;
+}
+
+void reader_destroy(struct frame_reader* reader) {
+
+    reader_thread_stop(reader);
+
+    reader->source->close(reader);
+
+    reader_pool_free(reader->decode_buffer);
+    pthread_mutex_destroy(&reader->events_lock);
+    free(reader->handles);
+    free(reader->frames);
+    free(reader);
+}
+
+// Switch a started reader to another format and resolution, e.g. between a preview and the full resolution, without
+// a new reader. Streaming stops, the source makes the buffers whose size changes again, the decode buffer is
+// borrowed anew from the pool and streaming (and the capture thread) resumes. reader->width and reader->height
+// are what the source granted. Frames and handles from before are gone. Returns -1 if the source can not switch
+// (errno ENOTSUP if it can not switch at all), the reader keeps the old format then. If the old format can not be
+// restored either the reader has no buffers (reader->frames is NULL, errno EIO). If the reader can not resume, e.g.
+// without memory for the decode buffer or when the stream or the capture thread does not start, it is left stopped and errno tells
+// why, it can be reconfigured again or destroyed.
+int reader_reconfigure_stopped(struct frame_reader* reader, enum supported_capture_format fmt, int width, int height,
+                               bool threaded) {
+    int status = reader->source->reconfigure(reader, fmt, width, height);
+    int error = errno;
+    if (reader->frames == NULL) {
+        errno = error;
+        return -1;
+    }
+    if (-1 == reader_alloc_decode_buffer(reader)) {
+        return -1;
+    }
+
+    if (-1 == reader_start(reader)) {
+        return -1;
+    }
+    if (threaded && -1 == reader_thread_start(reader)) {
+        int thread_error = errno;
+        reader_stop(reader);
+        errno = thread_error;
+        return -1;
+    }
+    errno = error;
+    return status;
+}
+
+int reader_reconfigure(struct frame_reader* reader, enum supported_capture_format fmt, int width, int height) {
+    if (reader->source->reconfigure == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if ((int)fmt == reader->fmt && width == reader->width && height == reader->height) {
+        return 0;
+    }
+
+    bool threaded = reader->capture_thread_running;
+    reader_stop(reader);
+    return reader_reconfigure_stopped(reader, fmt, width, height, threaded);
+}
+
+// Follow a source change (READER_EVENT_SOURCE_CHANGE), called by the consumer before it takes the next frame. The
+// reader switches to what the device delivers now, the buffers are made again even if the format looks the same.
+// Frames and handles from before are gone. The outcome is queued as reader_event_source_change. Returns -1 if the
+// reader could not follow, it keeps the old format then, or is left stopped (see reader_reconfigure_stopped) if its
+// capture thread did not start again.
+int reader_apply_source_change(struct frame_reader* reader) {
+    if (!atomic_load(&reader->source_change_pending)) {
+        return 0;
+    }
+
+    bool threaded = reader->capture_thread_running;
+    reader_stop(reader);
+    struct frame_reader_event event = reader->source_change;
+    event.type = reader_event_source_change;
+    reader->source_change = (struct frame_reader_event){0};
+    atomic_store(&reader->source_change_pending, false);
+
+    enum supported_capture_format fmt;
+    int width, height;
+    int status = -1;
+    int error = ENOTSUP;
+    if (reader->source->source_format != NULL) {
+        status = reader->source->source_format(reader, &fmt, &width, &height);
+        error = errno;
+    }
+    if (status == 0) {
+        status = reader_reconfigure_stopped(reader, fmt, width, height, threaded);
+        error = errno;
+    } else if (-1 == reader_start(reader)) {
+        error = errno;
+    } else if (threaded && -1 == reader_thread_start(reader)) {
+        // without the thread reader_thread_wait fails instead of waiting for frames which never come
+        error = errno;
+        reader_stop(reader);
+    }
+
+    event.reconfigured = status == 0;
+    event.error = status == 0 ? 0 : error;
+    event.fmt = reader->fmt;
+    event.width = reader->width;
+    event.height = reader->height;
+    atomic_fetch_add_explicit(status == 0 ? &reader->source_changes : &reader->source_change_failures, 1,
+                              memory_order_relaxed);
+    reader_push_event(reader, &event);
+    errno = error;
+    return status;
+}
+
+// Size of an uncompressed frame, 0 for MJPEG
+int reader_frame_size(enum supported_capture_format fmt, int width, int height) {
+    switch (fmt) {
+        case capture_format_RGB24:
+            return width * height * 3;
+        case capture_format_YUYV:
+            return width * height * 2;
+        case capture_format_NV12:
+        case capture_format_YVU420M:
+            return width * height * 3 / 2;
+        case capture_format_MJPEG:
+            return 0;
+    }
+    return 0;
+}
+
+// Recordings: a frame_reader_recording_header followed by one frame_reader_recording_frame plus bytesused bytes of
+// frame data per frame, in host byte order. Written by reader_recording_new/reader_recording_write and played back
+// by frame_source_replay.
+#define READER_RECORDING_MAGIC "FRRC"
+#define READER_RECORDING_VERSION 1
+
+struct frame_reader_recording_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t fmt;
+    uint32_t width;
+    uint32_t height;
+    uint32_t frame_size;
+};
+
+struct frame_reader_recording_frame {
+    uint32_t bytesused;
+    uint32_t sequence;
+    uint32_t flags;
+    uint32_t reserved;
+    // capture time in microseconds
+    int64_t timestamp;
+};
+
+FILE* reader_recording_new(const char* path, struct frame_reader* reader) {
+    FILE* recording = fopen(path, "wb");
+    if (recording == NULL) {
+        return NULL;
+    }
+
+    struct frame_reader_recording_header header = {0};
+    memcpy(header.magic, READER_RECORDING_MAGIC, sizeof(header.magic));
+    header.version = READER_RECORDING_VERSION;
+    header.fmt = reader->fmt;
+    header.width = reader->width;
+    header.height = reader->height;
+    header.frame_size = reader->frame_size;
+    if (1 != fwrite(&header, sizeof(header), 1, recording)) {
+        fclose(recording);
+        return NULL;
+    }
+    return recording;
+}
+
+int reader_recording_write(FILE* recording, const struct frame_reader_frame* frame) {
+    struct frame_reader_recording_frame record = {0};
+    for (size_t p = 0; p < frame->planes_length; ++p) {
+        record.bytesused += frame->planes[p].bytesused;
+    }
+    record.sequence = frame->sequence;
+    record.flags = frame->flags;
+    record.timestamp = (int64_t)frame->timestamp.tv_sec * 1000000 + frame->timestamp.tv_usec;
+    if (1 != fwrite(&record, sizeof(record), 1, recording)) {
+        return -1;
+    }
+    // multi-planar frames are stored with their planes back to back
+    for (size_t p = 0; p < frame->planes_length; ++p) {
+        size_t bytesused = frame->planes[p].bytesused;
+        if (bytesused > 0 && 1 != fwrite(frame->planes[p].ptr, bytesused, 1, recording)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// frame_source_replay options, see reader_new_replay
+struct frame_source_replay_options {
+    const char* path;
+    // hand out frames as fast as the consumer takes them instead of at the recorded timing
+    bool fast;
+    // start over at the end of the recording instead of reporting reader_result_end
+    bool loop;
+    // headerless files (raw frames back to back, or concatenated JPEGs for MJPEG) carry no timing, they are
+    // played back at fps (30 if not set) with the fmt, width and height passed to reader_new_replay
+    double fps;
+};
+
+struct frame_source_replay_frame {
+    size_t offset;
+    uint32_t bytesused;
+    uint32_t sequence;
+    uint32_t flags;
+    // microseconds
+    int64_t timestamp;
+};
+
+struct frame_source_replay {
+    // the whole file, frames are handed out straight from the mapping
+    uint8_t* data;
+    size_t data_length;
+    struct frame_source_replay_frame* frames;
+    size_t frames_length;
+    size_t next;
+    // frame slots handed out and not released yet
+    uint64_t held;
+    bool fast;
+    bool loop;
+    // frame i is due at base + frames[i].timestamp, CLOCK_MONOTONIC microseconds
+    int64_t base;
+    // time from the last frame of the recording to the first one when looping
+    int64_t loop_interval;
+};
+
+void reader_replay_add_frame(struct frame_source_replay* replay, size_t* capacity,
+                             struct frame_source_replay_frame frame) {
+    if (replay->frames_length == *capacity) {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        replay->frames = realloc(replay->frames, *capacity * sizeof(struct frame_source_replay_frame));
+    }
+    replay->frames[replay->frames_length++] = frame;
+}
+
+// Index a recording written by reader_recording_write
+int reader_replay_index_recording(struct frame_reader* reader, struct frame_source_replay* replay) {
+    struct frame_reader_recording_header header;
+    memcpy(&header, replay->data, sizeof(header));
+    if (header.version != READER_RECORDING_VERSION) {
+        return -1;
+    }
+    // the decoders trust the format and the frame size, a corrupt header must not send them past the mapping
+    if (header.fmt > capture_format_YVU420M || header.width == 0 || header.height == 0 ||
+        (uint64_t)header.width * header.height > INT32_MAX / 3 ||
+        header.frame_size < (uint32_t)reader_frame_size(header.fmt, header.width, header.height)) {
+        errno = EINVAL;
+        return -1;
+    }
+    bool uncompressed = header.fmt != capture_format_MJPEG;
+    reader->fmt = header.fmt;
+    reader->width = header.width;
+    reader->height = header.height;
+    reader->frame_size = header.frame_size;
+
+    size_t capacity = 0;
+    size_t offset = sizeof(header);
+    while (offset + sizeof(struct frame_reader_recording_frame) <= replay->data_length) {
+        struct frame_reader_recording_frame record;
+        memcpy(&record, replay->data + offset, sizeof(record));
+        offset += sizeof(record);
+        if (uncompressed && (record.bytesused < header.frame_size || record.bytesused > replay->data_length - offset)) {
+            errno = EINVAL;
+            return -1;
+        }
+        // an MJPEG recording cut short keeps its complete frames
+        if (record.bytesused > replay->data_length - offset) {
+            break;
+        }
+
+        struct frame_source_replay_frame frame = {
+            .offset = offset,
+            .bytesused = record.bytesused,
+            .sequence = record.sequence,
+            .flags = record.flags,
+            .timestamp = record.timestamp,
+        };
+        reader_replay_add_frame(replay, &capacity, frame);
+        offset += record.bytesused;
+    }
+    return 0;
+}
+
+// Offset of the next 0xff marker byte pair at or after offset, length if there is none
+size_t reader_replay_find_marker(const uint8_t* data, size_t length, size_t offset, uint8_t marker) {
+    for (; offset + 1 < length; ++offset) {
+        if (data[offset] == 0xff && data[offset + 1] == marker) {
+            return offset;
+        }
+    }
+    return length;
+}
+
+// Index a headerless file, fixed size frames or for MJPEG everything from a start of image to an end of image marker
+int reader_replay_index_raw(struct frame_reader* reader, struct frame_source_replay* replay, double fps) {
+    if (fps <= 0) {
+        fps = 30;
+    }
+    int64_t interval = 1000000 / fps;
+
+    size_t capacity = 0;
+    size_t offset = 0;
+    while (offset < replay->data_length) {
+        size_t bytes = 0;
+        if (reader->fmt == capture_format_MJPEG) {
+            size_t soi = reader_replay_find_marker(replay->data, replay->data_length, offset, 0xd8);
+            if (soi == replay->data_length) {
+                break;
+            }
+            offset = soi;
+            size_t eoi = reader_replay_find_marker(replay->data, replay->data_length, soi + 2, 0xd9);
+            bytes = (eoi < replay->data_length ? eoi + 2 : replay->data_length) - soi;
+        } else {
+            bytes = reader->frame_size;
+            if (bytes == 0 || bytes > replay->data_length - offset) {
+                break;
+            }
+        }
+
+        struct frame_source_replay_frame frame = {
+            .offset = offset,
+            .bytesused = bytes,
+            .sequence = replay->frames_length,
+            .flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC,
+            .timestamp = replay->frames_length * interval,
+        };
+        reader_replay_add_frame(replay, &capacity, frame);
+        offset += bytes;
+
+        if (reader->fmt == capture_format_MJPEG && bytes > (size_t)reader->frame_size) {
+            reader->frame_size = bytes;
+        }
+    }
+    replay->loop_interval = interval;
+    return 0;
+}
+
+// Arm the timer for the next frame, in fast mode reader->fd is an eventfd which is always readable
+void reader_replay_arm(struct frame_reader* reader) {
+    struct frame_source_replay* replay = reader->source_data;
+    if (replay->fast) {
+        return;
+    }
+
+    // clear a previous expiration, the fd must not stay readable until the next frame is due
+    uint64_t expirations;
+    (void)!read(reader->fd, &expirations, sizeof(expirations));
+
+    // past the end the timer fires right away, the consumer has to see the end of the stream
+    int64_t due = reader_monotonic_us();
+    if (replay->next < replay->frames_length) {
+        due = replay->base + replay->frames[replay->next].timestamp;
+    }
+    struct itimerspec timer = {0};
+    timer.it_value.tv_sec = due / 1000000;
+    timer.it_value.tv_nsec = (due % 1000000) * 1000;
+    timerfd_settime(reader->fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+int reader_replay_open(struct frame_reader* reader, const struct frame_reader_options* options,
+                       const void* source_options) {
+    (void) options;
+    const struct frame_source_replay_options* replay_options = source_options;
+    struct frame_source_replay* replay = calloc(1, sizeof(struct frame_source_replay));
+    reader->source_data = replay;
+    replay->fast = replay_options->fast;
+    replay->loop = replay_options->loop;
+
+    int fd = open(replay_options->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (-1 == fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    replay->data_length = st.st_size;
+    replay->data = mmap(NULL, replay->data_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay->data == MAP_FAILED) {
+        replay->data = NULL;
+        return -1;
+    }
+    madvise(replay->data, replay->data_length, MADV_SEQUENTIAL);
+
+    int status;
+    if (replay->data_length >= sizeof(struct frame_reader_recording_header) &&
+        0 == memcmp(replay->data, READER_RECORDING_MAGIC, 4)) {
+        status = reader_replay_index_recording(reader, replay);
+    } else {
+        status = reader_replay_index_raw(reader, replay, replay_options->fps);
+    }
+    if (status == -1 || replay->frames_length == 0) {
+        return -1;
+    }
+
+    if (replay->loop_interval == 0) {
+        // loop with the average frame interval of the recording
+        replay->loop_interval = 33333;
+        if (replay->frames_length > 1) {
+            replay->loop_interval = (replay->frames[replay->frames_length - 1].timestamp - replay->frames[0].timestamp) /
+                                    (int64_t)(replay->frames_length - 1);
+        }
+    }
+
+    if (replay->fast) {
+        reader->fd = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+    } else {
+        reader->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    }
+    if (reader->fd == -1) {
+        return -1;
+    }
+
+    // frames point into the mapping, the slots only limit how many the consumer may hold at once
+    reader->capture_buffers_length = reader->capture_buffers_requested;
+    reader_alloc_frames(reader);
+    return 0;
+}
+
+int reader_replay_start(struct frame_reader* reader) {
+    struct frame_source_replay* replay = reader->source_data;
+    if (replay->next == replay->frames_length && replay->loop) {
+        replay->next = 0;
+    }
+    if (replay->next < replay->frames_length) {
+        replay->base = reader_monotonic_us() - replay->frames[replay->next].timestamp;
+    }
+    reader_replay_arm(reader);
+    return 0;
+}
+
+struct frame_reader_frame* reader_replay_read(struct frame_reader* reader) {
+    struct frame_source_replay* replay = reader->source_data;
+    int64_t now = reader_monotonic_us();
+
+    if (replay->next == replay->frames_length) {
+        if (!replay->loop) {
+            errno = ENODATA;
+            return NULL;
+        }
+        // the first frame follows the last one after one frame interval
+        replay->base += replay->frames[replay->frames_length - 1].timestamp + replay->loop_interval -
+                        replay->frames[0].timestamp;
+        replay->next = 0;
+    }
+
+    struct frame_source_replay_frame* next = &replay->frames[replay->next];
+    if (!replay->fast && now < replay->base + next->timestamp) {
+        reader_replay_arm(reader);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    // like a driver without queued buffers, nothing is handed out while all slots are held
+    size_t slot = 0;
+    while (slot < reader->capture_buffers_length && (replay->held & (1ull << slot))) {
+        slot++;
+    }
+    if (slot == reader->capture_buffers_length) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    replay->held |= 1ull << slot;
+    replay->next++;
+
+    struct frame_reader_frame* frame = &reader->frames[slot];
+    frame->ptr = replay->data + next->offset;
+    frame->length = next->bytesused;
+    frame->bytesused = next->bytesused;
+    frame->sequence = next->sequence;
+    // frames are delivered now, not when they were recorded
+    frame->flags = (next->flags & ~V4L2_BUF_FLAG_TIMESTAMP_MASK) | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    reader_set_timestamp(frame, now);
+    reader_account_frame(reader, frame->sequence, frame->flags);
+
+    reader_replay_arm(reader);
+    return frame;
+}
+
+int reader_replay_release(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    struct frame_source_replay* replay = reader->source_data;
+    replay->held &= ~(1ull << frame->index);
+    return 0;
+}
+
+int reader_replay_stop(struct frame_reader* reader) {
+    struct frame_source_replay* replay = reader->source_data;
+    replay->held = 0;
+    if (!replay->fast) {
+        struct itimerspec timer = {0};
+        timerfd_settime(reader->fd, 0, &timer, NULL);
+    }
+    return 0;
+}
+
+void reader_replay_close(struct frame_reader* reader) {
+    struct frame_source_replay* replay = reader->source_data;
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    if (replay != NULL) {
+        if (replay->data != NULL) {
+            munmap(replay->data, replay->data_length);
+        }
+        free(replay->frames);
+        free(replay);
+    }
+}
+
+const struct frame_source frame_source_replay = {
+    .name = "replay",
+    .open = reader_replay_open,
+    .start = reader_replay_start,
+    .read = reader_replay_read,
+    .release = reader_replay_release,
+    .stop = reader_replay_stop,
+    .close = reader_replay_close,
+};
+
+// Play back a recording (reader_recording_write) or a headerless file of frames. fmt, width and height are only
+// used for headerless files, recordings carry their own.
+struct frame_reader* reader_new_replay(const struct frame_source_replay_options* replay_options,
+                                       enum supported_capture_format fmt, int width, int height,
+                                       const struct frame_reader_options* options) {
+    return reader_new_source(&frame_source_replay, replay_options, fmt, width, height,
+                             reader_frame_size(fmt, width, height), options);
+}
+
+// Synthetic test patterns, see reader_new_pattern
+enum frame_reader_pattern {
+    // vertical color bars
+    reader_pattern_bars,
+    // red rises from left to right, green from top to bottom
+    reader_pattern_gradient,
+    // new random bytes every frame, the worst case for MJPEG
+    reader_pattern_noise,
+};
+
+#define READER_PATTERN_MAX_WIDTH 7680
+#define READER_PATTERN_MAX_HEIGHT 4320
+// MJPEG frames are encoded once by open and handed out in a loop
+#define READER_PATTERN_JPEG_FRAMES 8
+#define READER_PATTERN_JPEG_QUALITY 75
+// the counter stamp in the top left corner, one block per bit of the sequence number, most significant bit first
+#define READER_PATTERN_STAMP_BITS 32
+#define READER_PATTERN_STAMP_BLOCK 16
+
+// Encode an RGB24 image to a JPEG of quality 1..100, returns a malloc'ed JPEG or NULL
+typedef uint8_t* (*frame_reader_jpeg_encoder)(const uint8_t* rgb, int width, int height, int quality, size_t* length);
+
+// frame_source_pattern options, see reader_new_pattern
+struct frame_source_pattern_options {
+    enum frame_reader_pattern pattern;
+    // frames per second, 0 hands out frames as fast as they are taken
+    double fps;
+    // MJPEG only, the reader can only decode JPEGs. Without an encoder MJPEG patterns fail with ENOTSUP.
+    frame_reader_jpeg_encoder encode_jpeg;
+};
+
+struct frame_source_pattern {
+    enum frame_reader_pattern pattern;
+    frame_reader_jpeg_encoder encode_jpeg;
+    bool paced;
+    // bars and gradient converted to the capture format once, every frame is this image rotated to the left
+    uint8_t* base;
+    // the frame as rows of row_length bytes, NV12 luma and chroma rows are rotated alike
+    size_t row_length;
+    size_t rows;
+    // bytes the image moves per frame
+    size_t step;
+    // MJPEG: frames pre-encoded by open
+    struct frame_reader_buffers jpeg[READER_PATTERN_JPEG_FRAMES];
+    // frame slots handed out and not released yet
+    uint64_t held;
+    uint32_t sequence;
+    uint32_t noise[4];
+};
+
+// Fill length bytes with xorshift noise, four 32 bit generators side by side
+void reader_pattern_fill_noise(uint8_t* data, size_t length, uint32_t state[4]) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i x = _mm_loadu_si128((__m128i*)state);
+    for (; i + 16 <= length; i += 16) {
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        _mm_storeu_si128((__m128i*)(data + i), x);
+    }
+    _mm_storeu_si128((__m128i*)state, x);
+#endif
+    for (; i < length; i += 4) {
+        uint32_t x = state[i / 4 % 4];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state[i / 4 % 4] = x;
+        memcpy(data + i, &x, length - i < 4 ? length - i : 4);
+    }
+}
+
+void reader_pattern_rgb(enum frame_reader_pattern pattern, uint8_t* rgb, int width, int height, uint32_t state[4]) {
+    const uint8_t bars[8][3] = {
+        {235, 235, 235}, {235, 235, 16}, {16, 235, 235}, {16, 235, 16},
+        {235, 16, 235},  {235, 16, 16},  {16, 16, 235},  {16, 16, 16},
+    };
+    switch (pattern) {
+        case reader_pattern_bars:
+            for (int x = 0; x < width; ++x) {
+                memcpy(rgb + x * 3, bars[x * 8 / width], 3);
+            }
+            for (int y = 1; y < height; ++y) {
+                memcpy(rgb + (size_t)y * width * 3, rgb, width * 3);
+            }
+            break;
+        case reader_pattern_gradient:
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                    uint8_t* p = rgb + ((size_t)y * width + x) * 3;
+                    p[0] = x * 255 / width;
+                    p[1] = y * 255 / height;
+                    p[2] = 255 - p[0];
+                }
+            }
+            break;
+        case reader_pattern_noise:
+            reader_pattern_fill_noise(rgb, (size_t)width * height * 3, state);
+            break;
+    }
+}
+
+// BT.601 limited range
+#define READER_RGB2Y(p) (16 + ((66 * (p)[0] + 129 * (p)[1] + 25 * (p)[2] + 128) >> 8))
+#define READER_RGB2U(p) (128 + ((-38 * (p)[0] - 74 * (p)[1] + 112 * (p)[2] + 128) >> 8))
+#define READER_RGB2V(p) (128 + ((112 * (p)[0] - 94 * (p)[1] - 18 * (p)[2] + 128) >> 8))
+
+// Convert an RGB24 image to fmt, chroma is taken from the top left pixel of every pair or 2x2 block
+void reader_pattern_convert(enum supported_capture_format fmt, const uint8_t* rgb, uint8_t* out, int width,
+                            int height) {
+    switch (fmt) {
+        case capture_format_RGB24:
+        case capture_format_MJPEG:
+            memcpy(out, rgb, (size_t)width * height * 3);
+            break;
+        case capture_format_YUYV:
+            for (size_t i = 0; i < (size_t)width * height; i += 2) {
+                const uint8_t* p = rgb + i * 3;
+                out[i * 2] = READER_RGB2Y(p);
+                out[i * 2 + 1] = READER_RGB2U(p);
+                out[i * 2 + 2] = READER_RGB2Y(p + 3);
+                out[i * 2 + 3] = READER_RGB2V(p);
+            }
+            break;
+        case capture_format_NV12:
+            for (size_t i = 0; i < (size_t)width * height; ++i) {
+                out[i] = READER_RGB2Y(rgb + i * 3);
+            }
+            uint8_t* uv = out + (size_t)width * height;
+            for (int y = 0; y < height; y += 2) {
+                for (int x = 0; x < width; x += 2) {
+                    const uint8_t* p = rgb + ((size_t)y * width + x) * 3;
+                    uv[(size_t)y / 2 * width + x] = READER_RGB2U(p);
+                    uv[(size_t)y / 2 * width + x + 1] = READER_RGB2V(p);
+                }
+            }
+            break;
+        case capture_format_YVU420M:
+            for (size_t i = 0; i < (size_t)width * height; ++i) {
+                out[i] = READER_RGB2Y(rgb + i * 3);
+            }
+            uint8_t* v_plane = out + (size_t)width * height;
+            uint8_t* u_plane = v_plane + (size_t)width * height / 4;
+            for (int y = 0; y < height; y += 2) {
+                for (int x = 0; x < width; x += 2) {
+                    const uint8_t* p = rgb + ((size_t)y * width + x) * 3;
+                    v_plane[(size_t)y / 2 * (width / 2) + x / 2] = READER_RGB2V(p);
+                    u_plane[(size_t)y / 2 * (width / 2) + x / 2] = READER_RGB2U(p);
+                }
+            }
+            break;
+    }
+}
+
+// Draw value as black and white blocks, fmt is the layout of frame (MJPEG frames are stamped as RGB24)
+void reader_pattern_stamp(enum supported_capture_format fmt, uint8_t* frame, int width, int height, uint32_t value) {
+    int block = READER_PATTERN_STAMP_BLOCK;
+    int block_height = height < block ? height & ~1 : block;
+    for (int bit = 0; bit < READER_PATTERN_STAMP_BITS && (bit + 1) * block <= width; ++bit) {
+        bool on = (value >> (READER_PATTERN_STAMP_BITS - 1 - bit)) & 1;
+        size_t x = bit * block;
+        for (int y = 0; y < block_height; ++y) {
+            size_t pixel = (size_t)y * width + x;
+            switch (fmt) {
+                case capture_format_RGB24:
+                case capture_format_MJPEG:
+                    memset(frame + pixel * 3, on ? 235 : 16, block * 3);
+                    break;
+                case capture_format_YUYV:
+                    for (int i = 0; i < block; ++i) {
+                        frame[(pixel + i) * 2] = on ? 235 : 16;
+                        frame[(pixel + i) * 2 + 1] = 128;
+                    }
+                    break;
+                case capture_format_NV12:
+                    memset(frame + pixel, on ? 235 : 16, block);
+                    if (y % 2 == 0) {
+                        memset(frame + (size_t)width * height + (size_t)y / 2 * width + x, 128, block);
+                    }
+                    break;
+                case capture_format_YVU420M:
+                    memset(frame + pixel, on ? 235 : 16, block);
+                    if (y % 2 == 0) {
+                        size_t chroma = (size_t)y / 2 * (width / 2) + x / 2;
+                        memset(frame + (size_t)width * height + chroma, 128, block / 2);
+                        memset(frame + (size_t)width * height * 5 / 4 + chroma, 128, block / 2);
+                    }
+                    break;
+            }
+        }
+    }
+}
+
+// Rotate every row of src left by offset bytes into dst
+void reader_pattern_rotate(uint8_t* dst, const uint8_t* src, size_t rows, size_t row_length, size_t offset) {
+    for (size_t y = 0; y < rows; ++y) {
+        memcpy(dst, src + offset, row_length - offset);
+        memcpy(dst + row_length - offset, src, offset);
+        dst += row_length;
+        src += row_length;
+    }
+}
+
+struct reader_pattern_jpeg_job {
+    struct frame_source_pattern* pattern;
+    int width;
+    int height;
+    size_t index;
+    uint32_t noise[4];
+    // the frame could not be rendered or encoded
+    bool failed;
+};
+
+// Render and encode MJPEG frame job->index, the pattern moves just like it does for the other formats
+void* reader_pattern_jpeg_encode(void* arg) {
+    struct reader_pattern_jpeg_job* job = arg;
+    struct frame_source_pattern* pattern = job->pattern;
+    size_t size = (size_t)job->width * job->height * 3;
+    uint8_t* rgb = reader_pool_alloc(size, 0);
+    if (rgb == NULL) {
+        job->failed = true;
+        return NULL;
+    }
+    reader_pattern_rgb(pattern->pattern, rgb, job->width, job->height, job->noise);
+    if (pattern->pattern != reader_pattern_noise) {
+        uint8_t* rotated = reader_pool_alloc(size, 0);
+        if (rotated == NULL) {
+            reader_pool_free(rgb);
+            job->failed = true;
+            return NULL;
+        }
+        reader_pattern_rotate(rotated, rgb, pattern->rows, pattern->row_length,
+                              job->index * pattern->step % pattern->row_length);
+        reader_pool_free(rgb);
+        rgb = rotated;
+    }
+    reader_pattern_stamp(capture_format_RGB24, rgb, job->width, job->height, job->index);
+    pattern->jpeg[job->index].ptr = pattern->encode_jpeg(rgb, job->width, job->height, READER_PATTERN_JPEG_QUALITY,
+                                                         &pattern->jpeg[job->index].length);
+    job->failed = pattern->jpeg[job->index].ptr == NULL;
+    reader_pool_free(rgb);
+    return NULL;
+}
+
+// YUYV pairs and NV12 2x2 chroma blocks
+bool reader_pattern_size_valid(int width, int height) {
+    return width > 0 && height > 0 && width % 2 == 0 && height % 2 == 0 && width <= READER_PATTERN_MAX_WIDTH &&
+           height <= READER_PATTERN_MAX_HEIGHT;
+}
+
+// Render the images and allocate the frame buffers for the reader's format and resolution
+int reader_pattern_setup(struct frame_reader* reader) {
+    struct frame_source_pattern* pattern = reader->source_data;
+    int width = reader->width;
+    int height = reader->height;
+    reader->frame_size = 0;
+
+    // move by about a hundredth of the width per frame, two pixels at a time
+    size_t step = 2 * (width / 640 > 0 ? width / 640 : 1);
+    switch (reader->fmt) {
+        case capture_format_RGB24:
+        case capture_format_MJPEG:
+            pattern->rows = height;
+            pattern->row_length = (size_t)width * 3;
+            pattern->step = step * 3;
+            break;
+        case capture_format_YUYV:
+            pattern->rows = height;
+            pattern->row_length = (size_t)width * 2;
+            pattern->step = step * 2;
+            break;
+        case capture_format_NV12:
+            pattern->rows = (size_t)height * 3 / 2;
+            pattern->row_length = width;
+            pattern->step = step;
+            break;
+        case capture_format_YVU420M:
+            // the luma rows, the chroma rows are half as long and move half as far (reader_pattern_read)
+            pattern->rows = height;
+            pattern->row_length = width;
+            pattern->step = step;
+            break;
+    }
+
+    if (reader->fmt == capture_format_MJPEG && pattern->encode_jpeg == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (reader->fmt == capture_format_MJPEG) {
+        // a real camera encodes every frame, here the encoder would be the bottleneck. The frames are independent
+        // and encoded in parallel.
+        pthread_t threads[READER_PATTERN_JPEG_FRAMES];
+        bool threaded[READER_PATTERN_JPEG_FRAMES];
+        struct reader_pattern_jpeg_job jobs[READER_PATTERN_JPEG_FRAMES];
+        for (size_t i = 0; i < READER_PATTERN_JPEG_FRAMES; ++i) {
+            jobs[i] = (struct reader_pattern_jpeg_job){.pattern = pattern, .width = width, .height = height, .index = i};
+            // noise needs a generator per frame
+            for (int k = 0; k < 4; ++k) {
+                jobs[i].noise[k] = pattern->noise[k] ^ (0x9e3779b9 * (i + 1));
+            }
+            threaded[i] = 0 == pthread_create(&threads[i], NULL, reader_pattern_jpeg_encode, &jobs[i]);
+            if (!threaded[i]) {
+                reader_pattern_jpeg_encode(&jobs[i]);
+            }
+        }
+        bool failed = false;
+        for (size_t i = 0; i < READER_PATTERN_JPEG_FRAMES; ++i) {
+            if (threaded[i]) {
+                pthread_join(threads[i], NULL);
+            }
+            failed |= jobs[i].failed;
+        }
+        // the frames which were encoded are freed by reader_pattern_free
+        if (failed) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (size_t i = 0; i < READER_PATTERN_JPEG_FRAMES; ++i) {
+            if ((size_t)reader->frame_size < pattern->jpeg[i].length) {
+                reader->frame_size = pattern->jpeg[i].length;
+            }
+        }
+    } else {
+        reader->frame_size = reader_frame_size(reader->fmt, width, height);
+        if (pattern->pattern != reader_pattern_noise) {
+            uint8_t* rgb = reader_pool_alloc((size_t)width * height * 3, 0);
+            pattern->base = reader_pool_alloc(reader->frame_size, 0);
+            if (rgb == NULL || pattern->base == NULL) {
+                reader_pool_free(rgb);
+                errno = ENOMEM;
+                return -1;
+            }
+            reader_pattern_rgb(pattern->pattern, rgb, width, height, pattern->noise);
+            reader_pattern_convert(reader->fmt, rgb, pattern->base, width, height);
+            reader_pool_free(rgb);
+        }
+    }
+
+    reader->capture_buffers_length = reader->capture_buffers_requested;
+    reader_alloc_frames(reader);
+    if (reader->fmt != capture_format_MJPEG) {
+        // frames are generated into pre-faulted buffers, page faults would show up as generator time
+        reader->capture_buffers =
+            reader_userptr_pool_new(reader->capture_buffers_length, reader->frame_size, reader->alloc_flags);
+        if (reader->capture_buffers == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+            reader->frames[i].ptr = reader->capture_buffers[i].ptr;
+            reader->frames[i].length = reader->frame_size;
+        }
+    }
+    return 0;
+}
+
+// Counterpart to reader_pattern_setup
+void reader_pattern_free(struct frame_reader* reader) {
+    struct frame_source_pattern* pattern = reader->source_data;
+    reader_userptr_pool_free(reader->capture_buffers, reader->capture_buffers_length);
+    reader->capture_buffers = NULL;
+    for (size_t i = 0; i < READER_PATTERN_JPEG_FRAMES; ++i) {
+        free(pattern->jpeg[i].ptr);
+        pattern->jpeg[i] = (struct frame_reader_buffers){0};
+    }
+    reader_pool_free(pattern->base);
+    pattern->base = NULL;
+}
+
+int reader_pattern_open(struct frame_reader* reader, const struct frame_reader_options* options,
+                        const void* source_options) {
+    (void) options;
+    const struct frame_source_pattern_options* pattern_options = source_options;
+    struct frame_source_pattern* pattern = calloc(1, sizeof(struct frame_source_pattern));
+    reader->source_data = pattern;
+    pattern->pattern = pattern_options->pattern;
+    pattern->encode_jpeg = pattern_options->encode_jpeg;
+    pattern->paced = pattern_options->fps > 0;
+    pattern->noise[0] = 0x9e3779b9;
+    pattern->noise[1] = 0x7f4a7c15;
+    pattern->noise[2] = 0x85ebca6b;
+    pattern->noise[3] = 0xc2b2ae35;
+
+    if (!reader_pattern_size_valid(reader->width, reader->height) || -1 == reader_pattern_setup(reader)) {
+        return -1;
+    }
+
+    if (pattern->paced) {
+        reader->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    } else {
+        reader->fd = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    if (reader->fd == -1) {
+        return -1;
+    }
+    if (pattern->paced) {
+        int64_t interval = 1e9 / pattern_options->fps;
+        reader->frame_interval = interval / 1000;
+        struct itimerspec timer = {0};
+        timer.it_interval.tv_sec = interval / 1000000000;
+        timer.it_interval.tv_nsec = interval % 1000000000;
+        timer.it_value = timer.it_interval;
+        timerfd_settime(reader->fd, 0, &timer, NULL);
+    }
+
+    return 0;
+}
+
+int reader_pattern_start(struct frame_reader* reader) {
+    // slots consumers still hold when the watchdog restarts
+    struct frame_source_pattern* pattern = reader->source_data;
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        if (atomic_load(&reader->buffer_holds[i]) > 0) {
+            pattern->held |= 1ull << i;
+        }
+    }
+    return 0;
+}
+
+struct frame_reader_frame* reader_pattern_read(struct frame_reader* reader) {
+    struct frame_source_pattern* pattern = reader->source_data;
+
+    uint64_t ticks = 1;
+    if (pattern->paced && -1 == read(reader->fd, &ticks, sizeof(ticks))) {
+        return NULL;
+    }
+
+    size_t slot = 0;
+    while (slot < reader->capture_buffers_length && (pattern->held & (1ull << slot))) {
+        slot++;
+    }
+    if (slot == reader->capture_buffers_length) {
+        // paced, every tick is a frame a camera without a queued buffer would have dropped. They show up as a gap
+        // in the sequence numbers (driver drops).
+        if (pattern->paced) {
+            pattern->sequence += ticks;
+        }
+        errno = EAGAIN;
+        return NULL;
+    }
+    pattern->held |= 1ull << slot;
+
+    // missed ticks are frames a camera would have dropped
+    pattern->sequence += ticks - 1;
+    uint32_t sequence = pattern->sequence++;
+
+    struct frame_reader_frame* frame = &reader->frames[slot];
+    if (reader->fmt == capture_format_MJPEG) {
+        struct frame_reader_buffers* jpeg = &pattern->jpeg[sequence % READER_PATTERN_JPEG_FRAMES];
+        frame->ptr = jpeg->ptr;
+        frame->length = jpeg->length;
+        frame->bytesused = jpeg->length;
+    } else {
+        if (pattern->pattern == reader_pattern_noise) {
+            reader_pattern_fill_noise(frame->ptr, reader->frame_size, pattern->noise);
+        } else {
+            size_t offset = (size_t)sequence * pattern->step % pattern->row_length;
+            reader_pattern_rotate(frame->ptr, pattern->base, pattern->rows, pattern->row_length, offset);
+            if (reader->fmt == capture_format_YVU420M) {
+                // both chroma planes in one go, they have the same row length
+                size_t luma = (size_t)reader->width * reader->height;
+                reader_pattern_rotate((uint8_t*)frame->ptr + luma, pattern->base + luma, reader->height,
+                                      pattern->row_length / 2, offset / 2);
+            }
+        }
+        reader_pattern_stamp(reader->fmt, frame->ptr, reader->width, reader->height, sequence);
+        frame->bytesused = reader->frame_size;
+    }
+
+    frame->sequence = sequence;
+    frame->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    reader_set_timestamp(frame, reader_monotonic_us());
+    reader_account_frame(reader, frame->sequence, frame->flags);
+    return frame;
+}
+
+int reader_pattern_release(struct frame_reader* reader, struct frame_reader_frame* frame) {
+    struct frame_source_pattern* pattern = reader->source_data;
+    pattern->held &= ~(1ull << frame->index);
+    return 0;
+}
+
+int reader_pattern_stop(struct frame_reader* reader) {
+    struct frame_source_pattern* pattern = reader->source_data;
+    pattern->held = 0;
+    return 0;
+}
+
+void reader_pattern_close(struct frame_reader* reader) {
+    struct frame_source_pattern* pattern = reader->source_data;
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    if (pattern != NULL) {
+        reader_pattern_free(reader);
+        free(pattern);
+    }
+}
+
+// The fd and the pacing stay, the images and the frame buffers are made again. If that fails the old format is
+// restored, if that fails too the reader has no buffers and errno is EIO.
+int reader_pattern_reconfigure(struct frame_reader* reader, enum supported_capture_format fmt, int width, int height) {
+    if (!reader_pattern_size_valid(width, height)) {
+        errno = EINVAL;
+        return -1;
+    }
+    enum supported_capture_format old_fmt = reader->fmt;
+    int old_width = reader->width;
+    int old_height = reader->height;
+
+    reader_pattern_free(reader);
+    reader->fmt = fmt;
+    reader->width = width;
+    reader->height = height;
+    if (0 == reader_pattern_setup(reader)) {
+        return 0;
+    }
+
+    int error = errno;
+    reader_pattern_free(reader);
+    reader->fmt = old_fmt;
+    reader->width = old_width;
+    reader->height = old_height;
+    if (-1 == reader_pattern_setup(reader)) {
+        // not even the old format is left
+        reader_pattern_free(reader);
+        free(reader->frames);
+        free(reader->handles);
+        reader->frames = NULL;
+        reader->handles = NULL;
+        reader->capture_buffers_length = 0;
+        errno = EIO;
+        return -1;
+    }
+    errno = error;
+    return -1;
+}
+
+const struct frame_source frame_source_pattern = {
+    .name = "pattern",
+    .open = reader_pattern_open,
+    .start = reader_pattern_start,
+    .read = reader_pattern_read,
+    .release = reader_pattern_release,
+    .stop = reader_pattern_stop,
+    .close = reader_pattern_close,
+    .reconfigure = reader_pattern_reconfigure,
+};
+
+// Generate moving test patterns with a frame counter stamp, in any format up to 7680x4320 (even width and height)
+// and without a device, e.g. to measure the decode throughput
+struct frame_reader* reader_new_pattern(const struct frame_source_pattern_options* pattern_options,
+                                        enum supported_capture_format fmt, int width, int height,
+                                        const struct frame_reader_options* options) {
+    return reader_new_source(&frame_source_pattern, pattern_options, fmt, width, height, 0, options);
+}
@@ -0,0 +1,312 @@
+// Minimal baseline JPEG encoder (YCbCr 4:2:0, standard Huffman tables) for the synthetic MJPEG frames of the pattern
+// source, see frame_source_pattern_options.encode_jpeg
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct jpeg_huffman {
+    uint16_t code[256];
+    uint8_t size[256];
+};
+
+struct jpeg_writer {
+    uint8_t* data;
+    size_t length;
+    size_t capacity;
+    uint32_t bits;
+    int bits_length;
+    // out of memory, everything after is dropped
+    bool failed;
+};
+
+const uint8_t jpeg_zigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+    41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+    30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+const uint8_t jpeg_luminance_quant[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,  14, 13, 16, 24, 40,  57,
+    69, 56, 14, 17, 22,  29,  51,  87,  80, 62, 18, 22, 37,  56,  68,  109, 103, 77, 24, 35, 55,  64,
+    81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+const uint8_t jpeg_chrominance_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99,
+    99, 99, 47, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+const uint8_t jpeg_dc_luminance_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+const uint8_t jpeg_dc_chrominance_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+const uint8_t jpeg_dc_values[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+const uint8_t jpeg_ac_luminance_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+const uint8_t jpeg_ac_luminance_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+    0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+const uint8_t jpeg_ac_chrominance_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+const uint8_t jpeg_ac_chrominance_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+void jpeg_huffman_init(struct jpeg_huffman* huffman, const uint8_t bits[16], const uint8_t* values) {
+    uint16_t code = 0;
+    size_t k = 0;
+    for (int length = 1; length <= 16; ++length) {
+        for (int i = 0; i < bits[length - 1]; ++i) {
+            huffman->code[values[k]] = code++;
+            huffman->size[values[k]] = length;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+void jpeg_put_byte(struct jpeg_writer* writer, uint8_t byte) {
+    if (writer->failed) {
+        return;
+    }
+    if (writer->length == writer->capacity) {
+        size_t capacity = writer->capacity == 0 ? 4096 : writer->capacity * 2;
+        uint8_t* data = realloc(writer->data, capacity);
+        if (data == NULL) {
+            writer->failed = true;
+            return;
+        }
+        writer->data = data;
+        writer->capacity = capacity;
+    }
+    writer->data[writer->length++] = byte;
+}
+
+void jpeg_put_marker(struct jpeg_writer* writer, uint8_t marker, uint16_t length) {
+    jpeg_put_byte(writer, 0xff);
+    jpeg_put_byte(writer, marker);
+    jpeg_put_byte(writer, length >> 8);
+    jpeg_put_byte(writer, length & 0xff);
+}
+
+void jpeg_put_bits(struct jpeg_writer* writer, uint32_t bits, int length) {
+    writer->bits = (writer->bits << length) | (bits & ((1u << length) - 1));
+    writer->bits_length += length;
+    while (writer->bits_length >= 8) {
+        uint8_t byte = writer->bits >> (writer->bits_length - 8);
+        jpeg_put_byte(writer, byte);
+        // a 0xff in entropy coded data is stuffed with a zero byte
+        if (byte == 0xff) {
+            jpeg_put_byte(writer, 0);
+        }
+        writer->bits_length -= 8;
+    }
+    writer->bits &= (1u << writer->bits_length) - 1;
+}
+
+void jpeg_put_huffman_table(struct jpeg_writer* writer, uint8_t id, const uint8_t bits[16], const uint8_t* values) {
+    size_t values_length = 0;
+    jpeg_put_byte(writer, id);
+    for (int i = 0; i < 16; ++i) {
+        jpeg_put_byte(writer, bits[i]);
+        values_length += bits[i];
+    }
+    for (size_t i = 0; i < values_length; ++i) {
+        jpeg_put_byte(writer, values[i]);
+    }
+}
+
+// AAN forward DCT (as in the IJG float DCT), the output is scaled by jpeg_divisors
+void jpeg_dct_1d(float* d, int stride) {
+    float tmp0 = d[0] + d[7 * stride], tmp7 = d[0] - d[7 * stride];
+    float tmp1 = d[stride] + d[6 * stride], tmp6 = d[stride] - d[6 * stride];
+    float tmp2 = d[2 * stride] + d[5 * stride], tmp5 = d[2 * stride] - d[5 * stride];
+    float tmp3 = d[3 * stride] + d[4 * stride], tmp4 = d[3 * stride] - d[4 * stride];
+
+    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+    d[0] = tmp10 + tmp11;
+    d[4 * stride] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2 * stride] = tmp13 + z1;
+    d[6 * stride] = tmp13 - z1;
+
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12) * 0.382683433f;
+    float z2 = 0.541196100f * tmp10 + z5;
+    float z4 = 1.306562965f * tmp12 + z5;
+    float z3 = tmp11 * 0.707106781f;
+    float z11 = tmp7 + z3, z13 = tmp7 - z3;
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+}
+
+// Quantization divisors including the AAN scale factors, quality 1..100
+void jpeg_divisors(float divisors[64], uint8_t quant[64], const uint8_t table[64], int quality) {
+    const float aan[8] = {1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+                          1.0f, 0.785694958f, 0.541196100f, 0.275899379f};
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; ++i) {
+        int q = (table[i] * scale + 50) / 100;
+        quant[i] = q < 1 ? 1 : q > 255 ? 255 : q;
+        divisors[i] = quant[i] * aan[i / 8] * aan[i % 8] * 8.0f;
+    }
+}
+
+void jpeg_put_value(struct jpeg_writer* writer, const struct jpeg_huffman* huffman, int run, int value) {
+    int magnitude = value < 0 ? -value : value;
+    int category = 0;
+    while (magnitude >> category) {
+        category++;
+    }
+    int symbol = (run << 4) | category;
+    jpeg_put_bits(writer, huffman->code[symbol], huffman->size[symbol]);
+    if (category > 0) {
+        jpeg_put_bits(writer, value < 0 ? value - 1 : value, category);
+    }
+}
+
+// block holds level shifted samples, it is transformed in place
+void jpeg_put_block(struct jpeg_writer* writer, float block[64], const float divisors[64], int* dc,
+                    const struct jpeg_huffman* dc_huffman, const struct jpeg_huffman* ac_huffman) {
+    for (int i = 0; i < 8; ++i) {
+        jpeg_dct_1d(block + i * 8, 1);
+    }
+    for (int i = 0; i < 8; ++i) {
+        jpeg_dct_1d(block + i, 8);
+    }
+
+    int coefficients[64];
+    for (int k = 0; k < 64; ++k) {
+        int i = jpeg_zigzag[k];
+        coefficients[k] = lrintf(block[i] / divisors[i]);
+    }
+
+    jpeg_put_value(writer, dc_huffman, 0, coefficients[0] - *dc);
+    *dc = coefficients[0];
+
+    int run = 0;
+    for (int k = 1; k < 64; ++k) {
+        if (coefficients[k] == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            jpeg_put_bits(writer, ac_huffman->code[0xf0], ac_huffman->size[0xf0]);
+            run -= 16;
+        }
+        jpeg_put_value(writer, ac_huffman, run, coefficients[k]);
+        run = 0;
+    }
+    if (run > 0) {
+        jpeg_put_bits(writer, ac_huffman->code[0x00], ac_huffman->size[0x00]);
+    }
+}
+
+// Encode an RGB24 image, returns a malloc'ed JPEG or NULL
+uint8_t* jpeg_encode(const uint8_t* rgb, int width, int height, int quality, size_t* length) {
+    struct jpeg_huffman dc_luminance, ac_luminance, dc_chrominance, ac_chrominance;
+    jpeg_huffman_init(&dc_luminance, jpeg_dc_luminance_bits, jpeg_dc_values);
+    jpeg_huffman_init(&ac_luminance, jpeg_ac_luminance_bits, jpeg_ac_luminance_values);
+    jpeg_huffman_init(&dc_chrominance, jpeg_dc_chrominance_bits, jpeg_dc_values);
+    jpeg_huffman_init(&ac_chrominance, jpeg_ac_chrominance_bits, jpeg_ac_chrominance_values);
+
+    float luminance_divisors[64], chrominance_divisors[64];
+    uint8_t luminance_quant[64], chrominance_quant[64];
+    jpeg_divisors(luminance_divisors, luminance_quant, jpeg_luminance_quant, quality);
+    jpeg_divisors(chrominance_divisors, chrominance_quant, jpeg_chrominance_quant, quality);
+
+    struct jpeg_writer writer = {0};
+    jpeg_put_byte(&writer, 0xff);
+    jpeg_put_byte(&writer, 0xd8);
+
+    jpeg_put_marker(&writer, 0xdb, 2 + 2 * 65);
+    jpeg_put_byte(&writer, 0);
+    for (int k = 0; k < 64; ++k) {
+        jpeg_put_byte(&writer, luminance_quant[jpeg_zigzag[k]]);
+    }
+    jpeg_put_byte(&writer, 1);
+    for (int k = 0; k < 64; ++k) {
+        jpeg_put_byte(&writer, chrominance_quant[jpeg_zigzag[k]]);
+    }
+
+    // baseline, 8 bit, Y sampled 2x2, Cb and Cr 1x1
+    jpeg_put_marker(&writer, 0xc0, 17);
+    const uint8_t frame_header[] = {
+        8, height >> 8, height & 0xff, width >> 8, width & 0xff, 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1,
+    };
+    for (size_t i = 0; i < sizeof(frame_header); ++i) {
+        jpeg_put_byte(&writer, frame_header[i]);
+    }
+
+    jpeg_put_marker(&writer, 0xc4, 2 + 4 * 17 + 12 + 162 + 12 + 162);
+    jpeg_put_huffman_table(&writer, 0x00, jpeg_dc_luminance_bits, jpeg_dc_values);
+    jpeg_put_huffman_table(&writer, 0x10, jpeg_ac_luminance_bits, jpeg_ac_luminance_values);
+    jpeg_put_huffman_table(&writer, 0x01, jpeg_dc_chrominance_bits, jpeg_dc_values);
+    jpeg_put_huffman_table(&writer, 0x11, jpeg_ac_chrominance_bits, jpeg_ac_chrominance_values);
+
+    jpeg_put_marker(&writer, 0xda, 12);
+    const uint8_t scan_header[] = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+    for (size_t i = 0; i < sizeof(scan_header); ++i) {
+        jpeg_put_byte(&writer, scan_header[i]);
+    }
+
+    int dc_y = 0, dc_cb = 0, dc_cr = 0;
+    for (int mcu_y = 0; mcu_y < height; mcu_y += 16) {
+        for (int mcu_x = 0; mcu_x < width; mcu_x += 16) {
+            float y[256], cb[64] = {0}, cr[64] = {0};
+            for (int i = 0; i < 256; ++i) {
+                // edge pixels are repeated into the padding
+                int px = mcu_x + i % 16, py = mcu_y + i / 16;
+                px = px < width ? px : width - 1;
+                py = py < height ? py : height - 1;
+                const uint8_t* p = rgb + ((size_t)py * width + px) * 3;
+                y[i] = 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2] - 128;
+                int c = (i / 32) * 8 + (i % 16) / 2;
+                cb[c] += (-0.168736f * p[0] - 0.331264f * p[1] + 0.5f * p[2]) / 4;
+                cr[c] += (0.5f * p[0] - 0.418688f * p[1] - 0.081312f * p[2]) / 4;
+            }
+            for (int b = 0; b < 4; ++b) {
+                float block[64];
+                for (int i = 0; i < 64; ++i) {
+                    block[i] = y[((b / 2) * 8 + i / 8) * 16 + (b % 2) * 8 + i % 8];
+                }
+                jpeg_put_block(&writer, block, luminance_divisors, &dc_y, &dc_luminance, &ac_luminance);
+            }
+            jpeg_put_block(&writer, cb, chrominance_divisors, &dc_cb, &dc_chrominance, &ac_chrominance);
+            jpeg_put_block(&writer, cr, chrominance_divisors, &dc_cr, &dc_chrominance, &ac_chrominance);
+        }
+    }
+
+    // pad the last byte with ones
+    jpeg_put_bits(&writer, 0x7f, 7);
+    jpeg_put_byte(&writer, 0xff);
+    jpeg_put_byte(&writer, 0xd9);
+
+    if (writer.failed) {
+        free(writer.data);
+        return NULL;
+    }
+    *length = writer.length;
+    return writer.data;
+}
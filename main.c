@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <time.h>
 #include <unistd.h>
@@ -14,7 +16,12 @@
 #include <GLFW/glfw3.h>
 
 #include "frame_reader.h"
+#include "jpeg_encoder.h"
 
+// decoded images come from the shared buffer pool, MJPEG decoding does not allocate once it has run for a frame
+#define STBI_MALLOC(size) reader_pool_alloc(size, 0)
+#define STBI_FREE(ptr) reader_pool_free(ptr)
+#define STBI_REALLOC_SIZED(ptr, old_size, new_size) reader_pool_realloc(ptr, new_size)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -150,116 +157,189 @@ size_t cpplen(char** ls) {
     return index;
 }
 
-char** list_devices(char** video_devices) {
-    char** devices = calloc(cpplen(video_devices), sizeof(char*));
-
-    int fd = 0;
-    struct v4l2_capability vid_caps = {0};
-    size_t wrt_ptr = 0;
-    for (size_t i = 0; video_devices[i] != NULL; i++) {
-        fd = open(video_devices[i], O_RDWR);
-        if (fd >= 0) {
-            int device_read_status = ioctl(fd, VIDIOC_QUERYCAP, &vid_caps);
-            if (device_read_status != -1 && (strcmp("uvcvideo", (char*)vid_caps.driver) == 0 || strcmp("v4l2 loopback", (char*)vid_caps.driver) == 0)) {
-                devices[wrt_ptr++] = strdup(video_devices[i]);
-            }
-        }
+char** dup_cpp(char** ls) {
+    char** copy = calloc(cpplen(ls), sizeof(char*));
+    for (size_t index = 0; ls[index] != NULL; index++) {
+        copy[index] = strdup(ls[index]);
     }
-        return devices;
+    return copy;
 }
 
-bool is_webcam_device(char* dev) {
-    bool is_lbdev = false;
+struct device_resolution {
+    // <width>x<height>, stepwise ranges are listed with their largest size
+    char name[20];
+    size_t width;
+    size_t height;
+    char** framerates;
+};
+
+struct device_format {
+    uint32_t pixel_format;
+    size_t resolutions_length;
+    struct device_resolution* resolutions;
+};
+
+// Everything probed from one video node
+struct device_info {
+    char* path;
+    // QUERYCAP succeeded, right after hotplug the node may not be accessible yet
+    bool queried;
+    struct v4l2_capability caps;
+    // capture methods, formats, resolutions and frame rates are probed on first use
+    bool probed;
+    char** capture_methods;
+    size_t formats_length;
+    struct device_format* formats;
+};
+
+// Cache of all /dev/video* nodes so every node is opened and probed only once. It is kept up to date with inotify,
+// nodes that appear, disappear or change permissions are queried again.
+struct device_registry {
+    // sorted by path
+    size_t devices_length;
+    struct device_info* devices;
+    // watches /dev, -1 if inotify is not available and the registry is never refreshed
+    int inotify_fd;
+};
+
+bool is_webcam_capability(struct v4l2_capability* vid_caps) {
+    return strcmp("uvcvideo", (char*)vid_caps->driver) == 0 || strcmp("v4l2 loopback", (char*)vid_caps->driver) == 0;
+}
 
-    char** video_devices = list_video_devices();
-    char** devices = list_devices(video_devices);
-    for (size_t i = 0; devices[i] != NULL; i++) {
-        if (strcmp(devices[i], dev) == 0) {
-            is_lbdev = true;
-            break;
-        }
-    }
+uint32_t device_capabilities(struct v4l2_capability* vid_caps) {
+    return (vid_caps->capabilities & V4L2_CAP_DEVICE_CAPS) ? vid_caps->device_caps : vid_caps->capabilities;
+}
 
-    free_cpp(video_devices);
-    free_cpp(devices);
+// Devices which only implement the multi-planar API have to be queried with it
+int capture_buf_type(struct v4l2_capability* vid_caps) {
+    uint32_t capabilities = device_capabilities(vid_caps);
+    if (!(capabilities & V4L2_CAP_VIDEO_CAPTURE) && (capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+        return V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    }
+    return V4L2_BUF_TYPE_VIDEO_CAPTURE;
+}
 
-    return is_lbdev;
+// Streaming devices report which memory types they support by accepting a REQBUFS with zero buffers
+bool supports_streaming_memory(int fd, int type, int memory) {
+    struct v4l2_requestbuffers requestbuffers = {0};
+    requestbuffers.type = type;
+    requestbuffers.memory = memory;
+    requestbuffers.count = 0;
+    return ioctl(fd, VIDIOC_REQBUFS, &requestbuffers) != -1;
 }
 
-char** list_capture_methods(char* dev) {
-    char** methods = calloc(3+1, sizeof(char*));
+char** probe_capture_methods(int fd, struct v4l2_capability* vid_caps) {
+    char** methods = calloc(5+1, sizeof(char*));
     size_t index = 0;
-    int fd;
-    struct v4l2_capability vid_caps = {0};
-
-    fd = open(dev, O_RDWR);
-
-    if (fd < 0) {
-        printf("Failed to open camera device!\n");
-        free(methods);
-        return NULL;
-    }
-
-    // query device capabilities
-    int query_cam = ioctl(fd, VIDIOC_QUERYCAP, &vid_caps);
-    if (query_cam == -1) {
-        printf("Failed to query camera!\n");
-        free(methods);
-        return NULL;
-    }
 
-    if (vid_caps.capabilities & V4L2_CAP_READWRITE) {
+    if (vid_caps->capabilities & V4L2_CAP_READWRITE) {
         methods[index++] = strdup("READ");
     }
 
-    if (vid_caps.capabilities & V4L2_MEMORY_MMAP) {
-        methods[index++] = strdup("MMAP");
-    }
+    if (vid_caps->capabilities & V4L2_CAP_STREAMING) {
+        int type = capture_buf_type(vid_caps);
+        if (supports_streaming_memory(fd, type, V4L2_MEMORY_MMAP)) {
+            methods[index++] = strdup("MMAP");
+        }
 
-    if (vid_caps.capabilities & V4L2_MEMORY_USERPTR) {
-        methods[index++] = strdup("USERPTR");
-    }
+        if (supports_streaming_memory(fd, type, V4L2_MEMORY_USERPTR)) {
+            methods[index++] = strdup("USERPTR");
+        }
 
-    if (vid_caps.capabilities & V4L2_MEMORY_DMABUF) {
-        methods[index++] = strdup("DMABUF");
+        if (supports_streaming_memory(fd, type, V4L2_MEMORY_DMABUF)) {
+            methods[index++] = strdup("DMABUF");
+        }
     }
 
-    if (vid_caps.capabilities & V4L2_MEMORY_OVERLAY) {
+    if (vid_caps->capabilities & V4L2_CAP_VIDEO_OVERLAY) {
         methods[index++] = strdup("OVERLAY");
     }
 
     return methods;
 }
 
-bool best_supported_capture_method(int fd, enum supported_capture_mode* cm) {
+char* setting2str(enum frame_reader_setting setting) {
+    switch (setting) {
+        case reader_setting_unused:
+            return "not set";
+        case reader_setting_applied:
+            return "applied";
+        case reader_setting_failed:
+            return "failed";
+    }
+    return "unknown";
+}
+
+void print_reader_event(const struct frame_reader_event* event) {
+    switch (event->type) {
+        case reader_event_source_change:
+            if (event->reconfigured) {
+                printf("Source changed, now capturing %s %dx%d\n", pixfmt2str(reader_v4l2_pixfmt(event->fmt)),
+                       event->width, event->height);
+            } else {
+                printf("Source changed, failed to follow: %s\n", strerror(event->error));
+            }
+            break;
+        case reader_event_eos:
+            printf("End of stream\n");
+            break;
+        case reader_event_ctrl:
+            printf("Control 0x%08x changed to %lld\n", event->ctrl_id, (long long)event->value);
+            break;
+    }
+}
 
+char* capture_mode2str(enum supported_capture_mode cm) {
+    switch (cm) {
+        case capture_mode_read:
+            return "READ";
+        case capture_mode_mmap:
+            return "MMAP";
+        case capture_mode_userptr:
+            return "USERPTR";
+        case capture_mode_uring:
+            return "URING";
+    }
+    return "unknown";
+}
+
+bool is_capture_method_supported(int fd, enum supported_capture_mode cm) {
     struct v4l2_capability vid_caps = {0};
 
     // query device capabilities
     int query_cam = ioctl(fd, VIDIOC_QUERYCAP, &vid_caps);
     if (query_cam == -1) {
         printf("Failed to query camera!\n");
-        return NULL;
+        return false;
     }
 
-    if (vid_caps.capabilities & V4L2_MEMORY_DMABUF) {
-        // not supported
+    int type = capture_buf_type(&vid_caps);
+    switch (cm) {
+        case capture_mode_read:
+        case capture_mode_uring:
+            return vid_caps.capabilities & V4L2_CAP_READWRITE;
+        case capture_mode_mmap:
+            return (vid_caps.capabilities & V4L2_CAP_STREAMING) &&
+                   supports_streaming_memory(fd, type, V4L2_MEMORY_MMAP);
+        case capture_mode_userptr:
+            return (vid_caps.capabilities & V4L2_CAP_STREAMING) &&
+                   supports_streaming_memory(fd, type, V4L2_MEMORY_USERPTR);
     }
+    return false;
+}
 
-    if (vid_caps.capabilities & V4L2_MEMORY_MMAP) {
-        *cm = capture_mode_mmap;
-        return true;
-    }
+bool best_supported_capture_method(int fd, enum supported_capture_mode* cm) {
 
-    if (vid_caps.capabilities & V4L2_MEMORY_USERPTR) {
-        // not supported
-    }
+    // DMABUF import and OVERLAY are not supported.
+    // USERPTR is supported but needs a buffer pool from the application, so it is only used when asked for.
+    // io_uring reads are only used when asked for as well.
 
-    if (vid_caps.capabilities & V4L2_MEMORY_OVERLAY) {
-        // not supported
+    if (is_capture_method_supported(fd, capture_mode_mmap)) {
+        *cm = capture_mode_mmap;
+        return true;
     }
 
-    if (vid_caps.capabilities & V4L2_CAP_READWRITE) {
+    if (is_capture_method_supported(fd, capture_mode_read)) {
         *cm = capture_mode_read;
         return true;
     }
@@ -267,78 +347,68 @@ bool best_supported_capture_method(int fd, enum supported_capture_mode* cm) {
     return false;
 }
 
-char** list_device_formats(char* dev) {
-    char** fmts;
-    int fd = 0;
-    struct v4l2_fmtdesc fmt = {0};
-
-    // open the device
-    fd = open(dev, O_RDWR);
-    if (fd < 0) {
-        printf("Failed to open camera device!\n");
-        return NULL;
-    }
-
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    fmt.index = 0;
-    while (ioctl(fd, VIDIOC_ENUM_FMT, &fmt) >= 0 && ++fmt.index);
-
-    fmts = calloc(fmt.index + 1, sizeof(char*));
-
-    fmt.index = 0;
-    while (ioctl(fd, VIDIOC_ENUM_FMT, &fmt) >= 0) {
-        fmts[fmt.index++] = strdup(pixfmt2str(fmt.pixelformat));
+// Format a frame interval as frames per second
+void interval2str(struct v4l2_fract* interval, char* str, size_t length) {
+    snprintf(str, length, "%.3f", interval->numerator != 0 ? (double)interval->denominator / interval->numerator : 0);
+}
+char** probe_framerates(int fd, uint32_t pixel_format, size_t width, size_t height) {
+    char** framerates;
+    struct v4l2_frmivalenum frmival = {0};
+
+    frmival.pixel_format = pixel_format;
+    frmival.width = width;
+    frmival.height = height;
+    frmival.index = 0;
+    while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) >= 0 && ++frmival.index);
+
+    framerates = calloc(frmival.index + 1, sizeof(char*));
+
+    frmival.index = 0;
+    while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) >= 0) {
+        framerates[frmival.index] = calloc(64, sizeof(char));
+        if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            char fps[20];
+            interval2str(&frmival.discrete, fps, sizeof(fps));
+            snprintf(framerates[frmival.index], 64, "%s fps (%u/%u s)", fps, frmival.discrete.numerator,
+                     frmival.discrete.denominator);
+        } else {
+            // continuous and stepwise ranges come as a single entry, the longest interval is the lowest rate
+            char min_fps[20], max_fps[20];
+            interval2str(&frmival.stepwise.max, min_fps, sizeof(min_fps));
+            interval2str(&frmival.stepwise.min, max_fps, sizeof(max_fps));
+            snprintf(framerates[frmival.index], 64, "%s-%s fps (%s)", min_fps, max_fps,
+                     frmival.type == V4L2_FRMIVAL_TYPE_CONTINUOUS ? "continuous" : "stepwise");
+        }
+        frmival.index++;
     }
 
-    close(fd);
-    return fmts;
+    return framerates;
 }
 
-char** list_device_resolutions(char* dev, char* search_format) {
-    char** resolutions;
-    int fd = 0;
+void probe_resolutions(int fd, struct device_format* format) {
     struct v4l2_frmsizeenum frmsize = {0};
 
-    // open the device
-    fd = open(dev, O_RDWR);
-    if (fd < 0) {
-        printf("Failed to open camera device!\n");
-        return NULL;
-    }
-
-    frmsize.pixel_format = str2pixfmt(search_format);
+    frmsize.pixel_format = format->pixel_format;
     frmsize.index = 0;
     while (ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0 && ++frmsize.index);
 
-    resolutions = calloc(frmsize.index + 1, sizeof(char*));
+    format->resolutions = calloc(frmsize.index, sizeof(struct device_resolution));
 
     frmsize.index = 0;
     while (ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0) {
-        resolutions[frmsize.index] = calloc(20, sizeof(char));  // 20 is a guess
+        struct device_resolution* resolution = &format->resolutions[frmsize.index];
         if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-            snprintf(resolutions[frmsize.index], 20, "%dx%d", frmsize.discrete.width, frmsize.discrete.height);
+            resolution->width = frmsize.discrete.width;
+            resolution->height = frmsize.discrete.height;
         } else if (frmsize.type == V4L2_FRMSIZE_TYPE_STEPWISE) {
-            snprintf(resolutions[frmsize.index], 20, "%dx%d", frmsize.stepwise.max_width, frmsize.stepwise.max_height);
+            resolution->width = frmsize.stepwise.max_width;
+            resolution->height = frmsize.stepwise.max_height;
         }
+        snprintf(resolution->name, sizeof(resolution->name), "%zux%zu", resolution->width, resolution->height);
+        resolution->framerates = probe_framerates(fd, format->pixel_format, resolution->width, resolution->height);
         frmsize.index++;
     }
-
-    close(fd);
-    return resolutions;
-}
-
-bool is_supported_format_resolution (char* dev, char* format, char* resolution) {
-    bool found = false;
-    char** resolutions = list_device_resolutions(dev, format);
-    for (size_t i = 0; resolutions[i] != NULL; i++) {
-        if (strcmp(resolutions[i], resolution) == 0) {
-            found = true;
-            break;
-        }
-    }
-    free_cpp(resolutions);
-    return found;
+    format->resolutions_length = frmsize.index;
 }
 
 void print_format(struct v4l2_format* vid_format) {
@@ -357,6 +427,23 @@ void print_format(struct v4l2_format* vid_format) {
         vid_format->fmt.pix.colorspace);
 }
 
+void print_format_mplane(struct v4l2_format* vid_format) {
+    struct v4l2_pix_format_mplane* pix_mp = &vid_format->fmt.pix_mp;
+    printf(
+        "vid_format->type                    =%d \n"
+        "vid_format->fmt.pix_mp.width        =%d \n"
+        "vid_format->fmt.pix_mp.height       =%d \n"
+        "vid_format->fmt.pix_mp.pixelformat  =%d (%s) \n"
+        "vid_format->fmt.pix_mp.field        =%d \n"
+        "vid_format->fmt.pix_mp.colorspace   =%d \n"
+        "vid_format->fmt.pix_mp.num_planes   =%d \n",
+        vid_format->type, pix_mp->width, pix_mp->height, pix_mp->pixelformat, pixfmt2str(pix_mp->pixelformat),
+        pix_mp->field, pix_mp->colorspace, pix_mp->num_planes);
+    for (size_t p = 0; p < pix_mp->num_planes && p < VIDEO_MAX_PLANES; ++p) {
+        printf("vid_format->fmt.pix_mp.plane_fmt[%zu] =%d bytes, %d bytes per line \n", p,
+               pix_mp->plane_fmt[p].sizeimage, pix_mp->plane_fmt[p].bytesperline);
+    }
+}
 void parse_resolution(char* res, size_t* width, size_t* height) {
     // most of this is safe if res was checked with is_supported_format_resolution
     char* res_pair = strdup(res);
@@ -369,202 +456,1352 @@ void parse_resolution(char* res, size_t* width, size_t* height) {
     *height = atoi(res_height);
     free(res_pair);
 }
+// Ask the driver for a frame rate, it picks the closest one it supports. type is the buffer type the device captures
+// with, multi-planar devices reject the single-planar one. Returns the rate it actually uses or 0 if the device can not
+// change it.
+double set_frame_rate(int fd, enum v4l2_buf_type type, double fps) {
+    struct v4l2_streamparm parm = {0};
+    parm.type = type;
+    if (ioctl(fd, VIDIOC_G_PARM, &parm) == -1 || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        return 0;
+    }
 
-// https://wiki.delphigl.com/index.php/glBegin
-#define OGLBQ0 -1, -1
-#define OGLBQ1 -1, 1
-#define OGLBQ2 1, 1
-#define OGLBQ3 1, -1
+    // fractional rates like 29.97 need a finer numerator than 1
+    if (fps == (uint32_t)fps) {
+        parm.parm.capture.timeperframe.numerator = 1;
+        parm.parm.capture.timeperframe.denominator = fps;
+    } else {
+        parm.parm.capture.timeperframe.numerator = 1000;
+        parm.parm.capture.timeperframe.denominator = lrint(fps * 1000);
+    }
+    if (ioctl(fd, VIDIOC_S_PARM, &parm) == -1 || parm.parm.capture.timeperframe.numerator == 0) {
+        return 0;
+    }
+    return (double)parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+}
+void device_info_free(struct device_info* info) {
+    for (size_t i = 0; i < info->formats_length; ++i) {
+        for (size_t j = 0; j < info->formats[i].resolutions_length; ++j) {
+            free_cpp(info->formats[i].resolutions[j].framerates);
+        }
+        free(info->formats[i].resolutions);
+    }
+    free(info->formats);
+    if (info->capture_methods != NULL) {
+        free_cpp(info->capture_methods);
+    }
+    free(info->path);
+}
 
-#define OGLTX0 0, 0
-#define OGLTX1 0, 1
-#define OGLTX2 1, 1
-#define OGLTX3 1, 0
+void device_info_query(struct device_info* info) {
+    int fd = open(info->path, O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+    info->queried = ioctl(fd, VIDIOC_QUERYCAP, &info->caps) != -1;
+    close(fd);
+}
+
+struct device_format* device_info_format(struct device_info* info, uint32_t pixel_format) {
+    for (size_t i = 0; i < info->formats_length; ++i) {
+        if (info->formats[i].pixel_format == pixel_format) {
+            return &info->formats[i];
+        }
+    }
+    return NULL;
+}
+
+// Probe capture methods, formats, resolutions and frame rates, only the first call opens the device
+bool device_info_probe(struct device_info* info) {
+    if (info->probed) {
+        return true;
+    }
 
-int read_texture(char* dev, char* fmt, char* res) {
+    int fd = open(info->path, O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
 
+    info->capture_methods = probe_capture_methods(fd, &info->caps);
+
+    // multi-planar formats are only listed by the multi-planar API, devices may implement both
+    uint32_t capabilities = device_capabilities(&info->caps);
+    int types[] = {
+        (capabilities & V4L2_CAP_VIDEO_CAPTURE) ? V4L2_BUF_TYPE_VIDEO_CAPTURE : 0,
+        (capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : 0,
+    };
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); ++t) {
+        struct v4l2_fmtdesc fmt = {0};
+        fmt.type = types[t];
+        for (fmt.index = 0; types[t] != 0 && ioctl(fd, VIDIOC_ENUM_FMT, &fmt) >= 0; fmt.index++) {
+            if (device_info_format(info, fmt.pixelformat) != NULL) {
+                continue;
+            }
+            info->formats = realloc(info->formats, (info->formats_length + 1) * sizeof(struct device_format));
+            struct device_format* format = &info->formats[info->formats_length++];
+            *format = (struct device_format){.pixel_format = fmt.pixelformat};
+            probe_resolutions(fd, format);
+        }
+    }
 
+    close(fd);
+    info->probed = true;
+    return true;
+}
 
-    // The plan
-    // 1. Initialize the Camera Device
-    // 2. Initialize the Frame Reader
-    // 3. Initialize OpenGL
-    // 4. Read images from the camera
-    // 5. Transfer image to OpenGL texture
-    // 6. Draw window
+// Order /dev/video2 before /dev/video10
+int device_path_compare(const char* a, const char* b) {
+    size_t a_length = strlen(a);
+    size_t b_length = strlen(b);
+    if (a_length != b_length) {
+        return a_length < b_length ? -1 : 1;
+    }
+    return strcmp(a, b);
+}
 
-    int fd = 0;
-    struct v4l2_capability vid_caps = {0};
-    struct v4l2_format vid_format = {0};
-    size_t width = 0;
-    size_t height = 0;
+// Add a node without querying it yet
+struct device_info* device_registry_insert(struct device_registry* registry, char* path) {
+    size_t index = 0;
+    while (index < registry->devices_length && device_path_compare(registry->devices[index].path, path) < 0) {
+        index++;
+    }
 
-    struct frame_reader* fr;
+    registry->devices = realloc(registry->devices, (registry->devices_length + 1) * sizeof(struct device_info));
+    memmove(&registry->devices[index + 1], &registry->devices[index],
+            (registry->devices_length - index) * sizeof(struct device_info));
+    registry->devices_length++;
 
-    parse_resolution(res, &width, &height);
+    struct device_info* info = &registry->devices[index];
+    *info = (struct device_info){0};
+    info->path = strdup(path);
+    return info;
+}
 
-    // STEP 1.: Initialize the Camera Device
+void device_registry_remove(struct device_registry* registry, size_t index) {
+    device_info_free(&registry->devices[index]);
+    memmove(&registry->devices[index], &registry->devices[index + 1],
+            (registry->devices_length - index - 1) * sizeof(struct device_info));
+    registry->devices_length--;
+}
 
-    // open the device
-    fd = open(dev, O_RDWR);
+// devices probed at the same time, UVC ioctls mostly wait for the device so this does not have to match the cores
+#define DEVICE_PROBE_THREADS 8
+
+struct device_probe_job {
+    struct device_info* devices;
+    size_t devices_length;
+    // also probe formats, resolutions and frame rates of webcams, not just QUERYCAP
+    bool probe;
+    atomic_size_t next;
+};
+
+void* device_probe_worker(void* arg) {
+    struct device_probe_job* job = arg;
+    size_t index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->devices_length) {
+        struct device_info* info = &job->devices[index];
+        if (!info->queried) {
+            device_info_query(info);
+        }
+        if (job->probe && info->queried && is_webcam_capability(&info->caps)) {
+            device_info_probe(info);
+        }
+    }
+    return NULL;
+}
 
-    if (fd < 0) {
+// Probe the devices on a small worker pool. Each device is only touched by the worker which took it and stays in its
+// slot, so the result is in the same order no matter which device answered first.
+void device_probe_parallel(struct device_info* devices, size_t devices_length, bool probe) {
+    struct device_probe_job job = {.devices = devices, .devices_length = devices_length, .probe = probe};
+    atomic_init(&job.next, 0);
+
+    // the calling thread works too, if no thread can be created it does everything
+    pthread_t threads[DEVICE_PROBE_THREADS - 1];
+    size_t threads_length = 0;
+    while (threads_length < DEVICE_PROBE_THREADS - 1 && threads_length + 1 < devices_length) {
+        if (0 != pthread_create(&threads[threads_length], NULL, device_probe_worker, &job)) {
+            break;
+        }
+        threads_length++;
+    }
+    device_probe_worker(&job);
+    for (size_t i = 0; i < threads_length; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Forget everything and query all nodes again
+void device_registry_scan(struct device_registry* registry) {
+    while (registry->devices_length > 0) {
+        device_registry_remove(registry, registry->devices_length - 1);
+    }
+
+    char** video_devices = list_video_devices();
+    if (video_devices == NULL) {
+        return;
+    }
+    for (size_t i = 0; video_devices[i] != NULL; i++) {
+        device_registry_insert(registry, video_devices[i]);
+    }
+    free_cpp(video_devices);
+
+    device_probe_parallel(registry->devices, registry->devices_length, false);
+}
+
+struct device_registry* device_registry_new() {
+    struct device_registry* registry = calloc(1, sizeof(struct device_registry));
+
+    // watch before scanning so no hotplug falls between the two
+    registry->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO;
+    if (registry->inotify_fd != -1 && inotify_add_watch(registry->inotify_fd, "/dev", mask) == -1) {
+        close(registry->inotify_fd);
+        registry->inotify_fd = -1;
+    }
+
+    device_registry_scan(registry);
+    return registry;
+}
+
+void device_registry_free(struct device_registry* registry) {
+    while (registry->devices_length > 0) {
+        device_registry_remove(registry, registry->devices_length - 1);
+    }
+    free(registry->devices);
+    if (registry->inotify_fd != -1) {
+        close(registry->inotify_fd);
+    }
+    free(registry);
+}
+
+// A node changed, drop what is cached for it and query it again if it still exists
+void device_registry_update(struct device_registry* registry, char* name, uint32_t mask) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/%s", name);
+
+    for (size_t i = 0; i < registry->devices_length; ++i) {
+        if (strcmp(registry->devices[i].path, path) == 0) {
+            device_registry_remove(registry, i);
+            break;
+        }
+    }
+
+    if (!(mask & (IN_DELETE | IN_MOVED_FROM))) {
+        device_info_query(device_registry_insert(registry, path));
+    }
+}
+
+// Apply pending hotplug events, never blocks
+void device_registry_refresh(struct device_registry* registry) {
+    if (registry->inotify_fd == -1) {
+        return;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(registry->inotify_fd, events, sizeof(events))) > 0) {
+        for (char* ptr = events; ptr < events + length;) {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, start over
+                device_registry_scan(registry);
+            } else if (event->len > 0 && strncmp(event->name, "video", 5) == 0) {
+                device_registry_update(registry, event->name, event->mask);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+struct device_info* device_registry_find(struct device_registry* registry, char* dev) {
+    device_registry_refresh(registry);
+    for (size_t i = 0; i < registry->devices_length; ++i) {
+        if (strcmp(registry->devices[i].path, dev) == 0) {
+            return &registry->devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Like device_registry_find but with formats, resolutions and frame rates probed, NULL if the device can not be opened
+struct device_info* device_registry_probe(struct device_registry* registry, char* dev) {
+    struct device_info* info = device_registry_find(registry, dev);
+    if (info == NULL || !info->queried || !device_info_probe(info)) {
+        return NULL;
+    }
+    return info;
+}
+
+// Probe formats, resolutions and frame rates of every webcam up front and in parallel, instead of one device at a time
+// on first use
+void device_registry_probe_all(struct device_registry* registry) {
+    device_registry_refresh(registry);
+    device_probe_parallel(registry->devices, registry->devices_length, true);
+}
+
+// The registry every query of this process goes through, created on first use
+struct device_registry* get_device_registry() {
+    static struct device_registry* registry = NULL;
+    if (registry == NULL) {
+        registry = device_registry_new();
+    }
+    return registry;
+}
+
+char** list_devices() {
+    struct device_registry* registry = get_device_registry();
+    device_registry_refresh(registry);
+
+    char** devices = calloc(registry->devices_length + 1, sizeof(char*));
+    size_t wrt_ptr = 0;
+    for (size_t i = 0; i < registry->devices_length; i++) {
+        if (registry->devices[i].queried && is_webcam_capability(&registry->devices[i].caps)) {
+            devices[wrt_ptr++] = strdup(registry->devices[i].path);
+        }
+    }
+    return devices;
+}
+
+bool is_webcam_device(char* dev) {
+    struct device_info* info = device_registry_find(get_device_registry(), dev);
+    return info != NULL && info->queried && is_webcam_capability(&info->caps);
+}
+
+char** list_capture_methods(char* dev) {
+    struct device_info* info = device_registry_probe(get_device_registry(), dev);
+    if (info == NULL) {
         printf("Failed to open camera device!\n");
-        return 1;
+        return NULL;
+    }
+    return dup_cpp(info->capture_methods);
+}
+
+char** list_device_formats(char* dev) {
+    struct device_info* info = device_registry_probe(get_device_registry(), dev);
+    if (info == NULL) {
+        printf("Failed to open camera device!\n");
+        return NULL;
+    }
+
+    char** fmts = calloc(info->formats_length + 1, sizeof(char*));
+    for (size_t i = 0; i < info->formats_length; ++i) {
+        fmts[i] = strdup(pixfmt2str(info->formats[i].pixel_format));
+    }
+    return fmts;
+}
+
+char** list_device_resolutions(char* dev, char* search_format) {
+    struct device_info* info = device_registry_probe(get_device_registry(), dev);
+    if (info == NULL) {
+        printf("Failed to open camera device!\n");
+        return NULL;
+    }
+
+    struct device_format* format = device_info_format(info, str2pixfmt(search_format));
+    size_t length = format != NULL ? format->resolutions_length : 0;
+    char** resolutions = calloc(length + 1, sizeof(char*));
+    for (size_t i = 0; i < length; ++i) {
+        resolutions[i] = strdup(format->resolutions[i].name);
+    }
+    return resolutions;
+}
+
+char** list_device_framerates(char* dev, char* search_format, char* resolution) {
+    struct device_info* info = device_registry_probe(get_device_registry(), dev);
+    if (info == NULL) {
+        printf("Failed to open camera device!\n");
+        return NULL;
+    }
+
+    struct device_format* format = device_info_format(info, str2pixfmt(search_format));
+    for (size_t i = 0; format != NULL && i < format->resolutions_length; ++i) {
+        if (strcmp(format->resolutions[i].name, resolution) == 0) {
+            return dup_cpp(format->resolutions[i].framerates);
+        }
+    }
+
+    // sizes inside a stepwise range are not cached
+    int fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        printf("Failed to open camera device!\n");
+        return NULL;
+    }
+    size_t width, height;
+    parse_resolution(resolution, &width, &height);
+    char** framerates = probe_framerates(fd, str2pixfmt(search_format), width, height);
+    close(fd);
+    return framerates;
+}
+
+bool is_supported_format_resolution (char* dev, char* format, char* resolution) {
+    struct device_info* info = device_registry_probe(get_device_registry(), dev);
+    if (info == NULL) {
+        return false;
+    }
+
+    struct device_format* device_format = device_info_format(info, str2pixfmt(format));
+    for (size_t i = 0; device_format != NULL && i < device_format->resolutions_length; i++) {
+        if (strcmp(device_format->resolutions[i].name, resolution) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// https://wiki.delphigl.com/index.php/glBegin
+#define OGLBQ0 -1, -1
+#define OGLBQ1 -1, 1
+#define OGLBQ2 1, 1
+#define OGLBQ3 1, -1
+
+#define OGLTX0 0, 0
+#define OGLTX1 0, 1
+#define OGLTX2 1, 1
+#define OGLTX3 1, 0
+
+struct playground_options {
+    struct frame_reader_options reader;
+    // use capture_mode instead of the best supported capture method
+    bool capture_mode_forced;
+    enum supported_capture_mode capture_mode;
+    // dequeue on a dedicated capture thread (reader_thread_start)
+    bool capture_thread;
+    // measure the capture to display latency of every pipeline stage
+    bool latency;
+    // frame rate to request from the device, 0 keeps the driver's default
+    double fps;
+    // resolution the R key switches to and back from while displaying, 0x0 if not set
+    size_t alt_width;
+    size_t alt_height;
+    // replay and bench only
+    struct frame_source_replay_options replay;
+    // pattern and bench-pattern only
+    struct frame_source_pattern_options pattern;
+};
+
+// Map a format name to the frame reader's format, false if the reader can not decode it
+bool str2capture_format(char* fmt, enum supported_capture_format* s_fmt) {
+    int capture_format = reader_capture_format(str2pixfmt(fmt));
+    if (capture_format == -1) {
+        return false;
+    }
+    *s_fmt = capture_format;
+    return true;
+}
+
+int capture_format2pixfmt(enum supported_capture_format s_fmt) {
+    return reader_v4l2_pixfmt(s_fmt);
+}
+
+// Open dev, negotiate format and resolution and create a frame reader for it. The device fd is reader->device_fd.
+struct frame_reader* open_frame_reader(char* dev, char* fmt, size_t width, size_t height,
+                                       struct playground_options* options) {
+    int fd = 0;
+    struct v4l2_capability vid_caps = {0};
+    struct v4l2_format vid_format = {0};
+
+    struct frame_reader* fr;
+
+    // open the device
+    fd = open(dev, O_RDWR);
+
+    if (fd < 0) {
+        printf("Failed to open camera device!\n");
+        return NULL;
+    }
+
+    // query device capabilities
+    int query_cam = ioctl(fd, VIDIOC_QUERYCAP, &vid_caps);
+    if (query_cam == -1) {
+        printf("Failed to query camera!\n");
+        close(fd);
+        return NULL;
+    }
+
+    enum supported_capture_format s_fmt;
+    if (!str2capture_format(fmt, &s_fmt)) {
+        printf("Format %s is currently not implemented", fmt);
+        close(fd);
+        return NULL;
+    }
+
+    // multi-planar formats and devices need the multi-planar API
+    enum v4l2_buf_type type = reader_v4l2_buf_type(fd, s_fmt);
+
+    // loading current fmt from device (this is only a sanity check)
+    vid_format.type = type;
+    int read_fmt = ioctl(fd, VIDIOC_G_FMT, &vid_format);
+    if (read_fmt == -1) {
+        printf("Failed to read fmt\n");
+        close(fd);
+        return NULL;
+    }
+
+    vid_format.type = type;
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        vid_format.fmt.pix_mp.width = width;
+        vid_format.fmt.pix_mp.height = height;
+        vid_format.fmt.pix_mp.pixelformat = str2pixfmt(fmt);
+        vid_format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        vid_format.fmt.pix_mp.colorspace = V4L2_COLORSPACE_SRGB;
+    } else {
+        vid_format.fmt.pix.width = width;
+        vid_format.fmt.pix.height = height;
+        vid_format.fmt.pix.pixelformat = str2pixfmt(fmt);
+        vid_format.fmt.pix.field = V4L2_FIELD_NONE;
+        vid_format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+    }
+
+
+    int put_fmt = ioctl(fd, VIDIOC_S_FMT, &vid_format);
+    if (put_fmt == -1) {
+        printf("Failed to write fmt\n");
+        close(fd);
+        return NULL;
+    }
+
+    // a multi-planar frame is the sum of its planes
+    size_t granted_width = vid_format.fmt.pix.width;
+    size_t granted_height = vid_format.fmt.pix.height;
+    size_t frame_size = vid_format.fmt.pix.sizeimage;
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        granted_width = vid_format.fmt.pix_mp.width;
+        granted_height = vid_format.fmt.pix_mp.height;
+        frame_size = 0;
+        for (size_t p = 0; p < vid_format.fmt.pix_mp.num_planes && p < VIDEO_MAX_PLANES; ++p) {
+            frame_size += vid_format.fmt.pix_mp.plane_fmt[p].sizeimage;
+        }
+    }
+
+    if (granted_width != width || granted_height != height) {
+        printf("Failed to set requested resoluition of %zux%zu, driver proposed %zux%zu\n", width, height,
+               granted_width, granted_height);
+        close(fd);
+        return NULL;
+    }
+
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        print_format_mplane(&vid_format);
+    } else {
+        print_format(&vid_format);
+    }
+
+    // the frame rate has to be set after the format, S_FMT may reset it
+    if (options->fps > 0) {
+        double fps = set_frame_rate(fd, type, options->fps);
+        if (fps == 0) {
+            printf("Device does not support setting the frame rate\n");
+        } else {
+            printf("Using %.3f fps (requested %.3f)\n", fps, options->fps);
+        }
+    }
+
+    // Initialize the Frame Reader
+    enum supported_capture_mode s_mode = capture_mode_mmap;
+    if (options->capture_mode_forced) {
+        s_mode = options->capture_mode;
+        if (!is_capture_method_supported(fd, s_mode)) {
+            printf("Capture method %s is not supported by the device\n", capture_mode2str(s_mode));
+            close(fd);
+            return NULL;
+        }
+    } else if (!best_supported_capture_method(fd, &s_mode)) {
+        printf("No compatible captore method found\n");
+        close(fd);
+        return NULL;
+    }
+
+    printf("Using capture method %s\n", capture_mode2str(s_mode));
+
+    if (s_mode == capture_mode_userptr) {
+        // the pool is owned by us, the driver writes straight into it
+        size_t pool_length = options->reader.capture_buffers_length;
+        if (pool_length == 0) {
+            pool_length = reader_policy_buffers(options->reader.policy);
+        }
+        // the same pool is used after switching to the alternative resolution, frames grow with their pixels
+        size_t pool_frame_size = frame_size;
+        if (options->alt_width * options->alt_height > width * height) {
+            pool_frame_size = frame_size * options->alt_width * options->alt_height / (width * height);
+        }
+        options->reader.userptr_buffers =
+            reader_userptr_pool_new(pool_length, pool_frame_size, options->reader.alloc_flags);
+        options->reader.userptr_buffers_length = pool_length;
+        if (options->reader.userptr_buffers == NULL) {
+            printf("Failed to allocate the userptr buffer pool\n");
+            close(fd);
+            return NULL;
+        }
+    }
+
+    // the watchdog opens the device again after a USB reset
+    options->reader.device_path = dev;
+    fr = reader_new_with_options(fd, s_mode, s_fmt, width, height, frame_size, &options->reader);
+    if (fr == NULL) {
+        printf("Failed to initialize the frame reader\n");
+        reader_userptr_pool_free(options->reader.userptr_buffers, options->reader.userptr_buffers_length);
+        close(fd);
+        return NULL;
+    }
+
+    if (s_mode == capture_mode_mmap || s_mode == capture_mode_userptr || s_mode == capture_mode_uring) {
+        printf("Using %zu capture buffers (requested %zu)\n", fr->capture_buffers_length, fr->capture_buffers_requested);
+    }
+
+    if (options->reader.export_dmabuf) {
+        for (size_t i = 0; i < fr->capture_buffers_length; ++i) {
+            printf("Buffer %zu exported as DMABUF fd %d\n", i, fr->frames[i].dmabuf_fd);
+        }
+    }
+
+    return fr;
+}
+
+void print_reader_stats(struct frame_reader* fr) {
+    struct frame_reader_stats stats = reader_stats(fr);
+    printf(
+        "frames          =%lu \n"
+        "driver drops    =%lu \n"
+        "consumer drops  =%lu (skipped %lu, ring overflows %lu, superseded %lu) \n"
+        "error frames    =%lu \n"
+        "copied frames   =%lu \n",
+        (unsigned long)stats.frames, (unsigned long)stats.driver_drops, (unsigned long)stats.consumer_drops,
+        (unsigned long)stats.frames_skipped, (unsigned long)stats.ring_overflows,
+        (unsigned long)stats.frames_superseded, (unsigned long)stats.error_frames, (unsigned long)stats.frames_copied);
+    if (stats.requeue_failures > 0) {
+        printf("requeue failures=%lu \n", (unsigned long)stats.requeue_failures);
+    }
+    if (fr->options.watchdog_intervals > 0) {
+        printf("recoveries      =%lu restarts, %lu reopens, %lu failed (stalls %lu, device errors %lu) \n",
+               (unsigned long)stats.stream_restarts, (unsigned long)stats.device_reopens,
+               (unsigned long)stats.recovery_failures, (unsigned long)stats.stalls, (unsigned long)stats.device_errors);
+    }
+    if (fr->options.events != 0) {
+        printf("events          =%lu (dropped %lu), source changes %lu followed, %lu failed \n",
+               (unsigned long)stats.events, (unsigned long)stats.events_dropped,
+               (unsigned long)stats.source_changes, (unsigned long)stats.source_change_failures);
+    }
+    if (stats.capture_affinity != reader_setting_unused || stats.capture_scheduling != reader_setting_unused ||
+        stats.decode_affinity != reader_setting_unused) {
+        printf("threads         =capture cpus %s, capture scheduling %s, decode cpus %s \n",
+               setting2str(stats.capture_affinity), setting2str(stats.capture_scheduling),
+               setting2str(stats.decode_affinity));
+    }
+    if (fr->alloc_flags != 0 && fr->decode_buffer != NULL) {
+        printf("decode buffer   =huge pages %s, locked %s \n",
+               (fr->decode_buffer_flags & READER_ALLOC_HUGEPAGES) ? "yes" : "no",
+               (fr->decode_buffer_flags & READER_ALLOC_MLOCK) ? "yes" : "no");
+    }
+    struct frame_reader_pool_stats pool = reader_pool_stats();
+    printf("buffer pool     =%lu allocations, %lu reuses, %zu KiB in use, %zu KiB cached \n",
+           (unsigned long)pool.allocations, (unsigned long)pool.reuses, pool.used_bytes >> 10, pool.cached_bytes >> 10);
+}
+
+void print_latency(struct frame_reader_latency* latency) {
+    printf("stage      frames     p50 us     p99 us     max us\n");
+    for (int stage = 0; stage < reader_stage_count; stage++) {
+        struct frame_reader_latency_histogram* histogram = &latency->stages[stage];
+        printf("%-8s %8lu %10lu %10lu %10lu\n", reader_stage_name(stage), (unsigned long)histogram->count,
+               (unsigned long)reader_latency_percentile(histogram, 50), (unsigned long)reader_latency_percentile(histogram, 99),
+               (unsigned long)histogram->max);
+    }
+}
+
+// Counterpart to open_frame_reader and open_replay_reader
+void close_frame_reader(struct frame_reader* fr, struct playground_options* options) {
+    int fd = fr->device_fd;
+    reader_destroy(fr);
+    reader_userptr_pool_free(options->reader.userptr_buffers, options->reader.userptr_buffers_length);
+    options->reader.userptr_buffers = NULL;
+    options->reader.userptr_buffers_length = 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// R requests a switch between the stream's resolution and --alt-resolution
+void display_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    (void)scancode;
+    (void)mods;
+    bool* switch_requested = glfwGetWindowUserPointer(window);
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+        *switch_requested = true;
+    }
+}
+
+// STEP 3. to 6.: show the frames of fr in a window until it is closed or the source ends, fr is stopped afterwards
+int display_frames(struct frame_reader* fr, char* title, struct playground_options* options) {
+    size_t width = fr->width;
+    size_t height = fr->height;
+
+    // STEP 3.: Initialize the OpenGL
+    GLFWwindow* gl_ctx;
+    GLenum err;
+
+    GLuint texture;
+
+    // create opengl context + window
+    glfwInit();
+    glfwDefaultWindowHints();
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    gl_ctx =
+        glfwCreateWindow(width, height, title, NULL, NULL);
+    if (!gl_ctx) {
+        printf("Failed to create opengl context\n");
+        return 1;
+    }
+
+    glfwMakeContextCurrent(gl_ctx);
+    err = glewInit();
+    if (GLEW_OK != err) {
+        printf("Failed to init glew\n");
+        return 1;
+    }
+
+    // generate texture
+    glEnable(GL_TEXTURE_2D);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glGenTextures(1, &texture);
+
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    size_t stream_width = width;
+    size_t stream_height = height;
+    bool switch_requested = false;
+    if (options->alt_width > 0) {
+        glfwSetWindowUserPointer(gl_ctx, &switch_requested);
+        glfwSetKeyCallback(gl_ctx, display_key_callback);
+    }
+
+    if (-1 == reader_start(fr)) {
+        printf("Failed to start streaming: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (options->capture_thread && -1 == reader_thread_start(fr)) {
+        printf("Failed to start the capture thread\n");
+        reader_stop(fr);
+        return 1;
+    }
+    // this thread decodes, it is pinned after the capture thread started so that one does not inherit its CPUs
+    if (-1 == reader_decode_thread_setup(fr)) {
+        printf("Failed to pin the decode thread\n");
+    }
+
+    void* image_data = NULL;
+    struct frame_reader_frame* frame = NULL;
+    // copy of the metadata of the frame in flight, the buffer itself goes back to the capture thread before the swap
+    struct frame_reader_frame shown = {0};
+    struct frame_reader_latency* latency = calloc(1, sizeof(struct frame_reader_latency));
+
+    while (!glfwWindowShouldClose(gl_ctx)) {
+
+        // the reader keeps running, only its buffers change
+        if (switch_requested) {
+            switch_requested = false;
+            bool alternative = (size_t)fr->width == stream_width && (size_t)fr->height == stream_height;
+            size_t next_width = alternative ? options->alt_width : stream_width;
+            size_t next_height = alternative ? options->alt_height : stream_height;
+            double start = monotonic_seconds();
+            if (-1 == reader_reconfigure(fr, fr->fmt, next_width, next_height)) {
+                printf("Failed to switch to %zux%zu: %s\n", next_width, next_height, strerror(errno));
+                if (fr->frames == NULL) {
+                    break;
+                }
+            } else {
+                printf("Switched to %dx%d in %.1f ms\n", fr->width, fr->height, (monotonic_seconds() - start) * 1000);
+            }
+            width = fr->width;
+            height = fr->height;
+        }
+
+        // STEP 4. Read images from the source, without blocking the render loop. If there is no new frame the last
+        // texture is drawn again.
+        image_data = NULL;
+        if (options->capture_thread) {
+            frame = reader_thread_pop(fr);
+            // the capture thread is gone, e.g. at the end of a replay
+            if (frame == NULL && -1 == reader_thread_wait(fr, 0)) {
+                break;
+            }
+        } else {
+            enum frame_reader_result result = reader_try_read_frame(fr, &frame);
+            if (result == reader_result_end) {
+                break;
+            }
+            if (result != reader_result_frame) {
+                frame = NULL;
+            }
+        }
+
+        // a source change was followed before the frame was taken, it already has the new size
+        struct frame_reader_event event;
+        bool source_lost = false;
+        while (reader_next_event(fr, &event)) {
+            print_reader_event(&event);
+            if (event.type == reader_event_source_change) {
+                width = stream_width = fr->width;
+                height = stream_height = fr->height;
+                source_lost = fr->frames == NULL;
+            }
+        }
+        if (source_lost) {
+            break;
+        }
+
+        if (frame != NULL) {
+            shown = *frame;
+            reader_latency_record(latency, reader_stage_dequeue, &shown);
+            image_data = reader_decode_rgb(fr, frame);
+            reader_latency_record(latency, reader_stage_decode, &shown);
+        }
+
+        // STEP 5. Transfer image to OpenGL texture
+        if (image_data != NULL) {
+            glTexImage2D(GL_TEXTURE_2D, 0, fr->texture_format, width, height, 0, fr->texture_format, GL_UNSIGNED_BYTE, image_data);
+            reader_latency_record(latency, reader_stage_upload, &shown);
+        }
+
+        // the capture thread can reuse the buffer once it is uploaded
+        if (options->capture_thread && frame != NULL) {
+            reader_thread_release(fr, frame);
+        }
+
+        // STEP 6. Draw Window
+        glViewport(0, 0, width, height);
+        glfwSetWindowSize(gl_ctx, width, height);
+        glBegin(GL_QUADS);
+        glTexCoord2f(OGLTX1);
+        glVertex2f(OGLBQ0);
+        glTexCoord2f(OGLTX0);
+        glVertex2f(OGLBQ1);
+        glTexCoord2f(OGLTX3);
+        glVertex2f(OGLBQ2);
+        glTexCoord2f(OGLTX2);
+        glVertex2f(OGLBQ3);
+
+        /*
+        glBegin(GL_QUADS);
+        glTexCoord2f(OGLTX0);
+        glVertex2f(OGLBQ0);
+        glTexCoord2f(OGLTX1);
+        glVertex2f(OGLBQ1);
+        glTexCoord2f(OGLTX2);
+        glVertex2f(OGLBQ2);
+        glTexCoord2f(OGLTX3);
+        glVertex2f(OGLBQ3);
+        */
+        glEnd();
+
+        glFlush();
+        glfwSwapBuffers(gl_ctx);
+        if (image_data != NULL) {
+            reader_latency_record(latency, reader_stage_swap, &shown);
+        }
+        glfwPollEvents();
+
+        //usleep(1.0f / 30 * 1000000.0f);
+    }
+
+    print_reader_stats(fr);
+    if (options->latency) {
+        print_latency(latency);
+    }
+    free(latency);
+
+    reader_stop(fr);
+
+    glDeleteTextures(1, &texture);
+    glfwDestroyWindow(gl_ctx);
+    glfwTerminate();
+
+    return 0;
+}
+
+struct count_frames_device {
+    char* dev;
+    struct playground_options options;
+    struct frame_reader* reader;
+    size_t frames;
+    size_t errors;
+};
+
+void count_frames_callback(struct frame_reader* reader, struct frame_reader_frame* frame, void* user_data) {
+    struct count_frames_device* device = user_data;
+    (void)reader;
+    if (frame == NULL) {
+        device->errors++;
+        return;
+    }
+    device->frames++;
+}
+
+// Capture from all given devices on a single thread and report the frame rate of each
+int count_frames(char** devs, size_t devs_length, char* fmt, char* res, double seconds,
+                 struct playground_options* options) {
+    size_t width = 0;
+    size_t height = 0;
+    parse_resolution(res, &width, &height);
+
+    struct frame_reader_loop* loop = reader_loop_new();
+    if (loop == NULL) {
+        printf("Failed to create the event loop\n");
+        return 1;
+    }
+
+    struct count_frames_device* devices = calloc(devs_length, sizeof(struct count_frames_device));
+    int status = 0;
+    for (size_t i = 0; i < devs_length; i++) {
+        devices[i].dev = devs[i];
+        devices[i].options = *options;
+        devices[i].reader = open_frame_reader(devs[i], fmt, width, height, &devices[i].options);
+        if (devices[i].reader == NULL) {
+            status = 1;
+            break;
+        }
+        if (-1 == reader_loop_add(loop, devices[i].reader, count_frames_callback, &devices[i])) {
+            printf("Failed to add %s to the event loop: %s\n", devs[i], strerror(errno));
+            status = 1;
+            break;
+        }
+        if (-1 == reader_start(devices[i].reader)) {
+            printf("Failed to start streaming on %s: %s\n", devs[i], strerror(errno));
+            status = 1;
+            break;
+        }
+    }
+
+    double start = monotonic_seconds();
+    double now = start;
+    while (status == 0 && now - start < seconds) {
+        int timeout = (seconds - (now - start)) * 1000 + 1;
+        if (-1 == reader_loop_run_once(loop, timeout)) {
+            printf("Failed to wait for frames\n");
+            status = 1;
+        }
+        now = monotonic_seconds();
+    }
+
+    for (size_t i = 0; i < devs_length; i++) {
+        if (devices[i].reader == NULL) {
+            continue;
+        }
+        if (status == 0) {
+            printf("%s: %zu frames (%.2f fps), %zu errors\n", devices[i].dev, devices[i].frames,
+                   devices[i].frames / (now - start), devices[i].errors);
+            print_reader_stats(devices[i].reader);
+        }
+        reader_stop(devices[i].reader);
+        close_frame_reader(devices[i].reader, &devices[i].options);
+    }
+
+    reader_loop_destroy(loop);
+    free(devices);
+    return status;
+}
+
+int read_texture(char* dev, char* fmt, char* res, struct playground_options* options) {
+
+
+
+    // The plan
+    // 1. Initialize the Camera Device
+    // 2. Initialize the Frame Reader
+    // 3. Initialize OpenGL
+    // 4. Read images from the camera
+    // 5. Transfer image to OpenGL texture
+    // 6. Draw window
+
+    size_t width = 0;
+    size_t height = 0;
+
+    struct frame_reader* fr;
+
+    parse_resolution(res, &width, &height);
+
+    // STEP 1. and 2.: Initialize the Camera Device and the Frame Reader
+    fr = open_frame_reader(dev, fmt, width, height, options);
+    if (fr == NULL) {
+        return 1;
+    }
+
+    int status = display_frames(fr, "Display OpenGL texture populated from video device", options);
+
+    close_frame_reader(fr, options);
+    return status;
+}
+
+// Capture frames from dev into a recording for replay
+int record(char* dev, char* fmt, char* res, char* path, size_t frames, struct playground_options* options) {
+    size_t width = 0;
+    size_t height = 0;
+    parse_resolution(res, &width, &height);
+
+    struct frame_reader* fr = open_frame_reader(dev, fmt, width, height, options);
+    if (fr == NULL) {
+        return 1;
+    }
+
+    FILE* recording = reader_recording_new(path, fr);
+    if (recording == NULL) {
+        printf("Failed to create recording '%s'\n", path);
+        close_frame_reader(fr, options);
+        return 1;
+    }
+
+    int status = 0;
+    if (-1 == reader_start(fr)) {
+        printf("Failed to start streaming: %s\n", strerror(errno));
+        status = 1;
+    }
+    for (size_t i = 0; status == 0 && i < frames; i++) {
+        struct frame_reader_frame* frame = reader_read_frame(fr);
+        if (frame == NULL) {
+            printf("Failed to read frame\n");
+            status = 1;
+            break;
+        }
+        if (-1 == reader_recording_write(recording, frame)) {
+            printf("Failed to write frame\n");
+            status = 1;
+            break;
+        }
+    }
+    reader_stop(fr);
+
+    if (0 != fclose(recording)) {
+        status = 1;
+    }
+    print_reader_stats(fr);
+    close_frame_reader(fr, options);
+    return status;
+}
+
+// fmt and res may be NULL for recordings, they carry their own
+struct frame_reader* open_replay_reader(char* path, char* fmt, char* res, struct playground_options* options) {
+    size_t width = 0;
+    size_t height = 0;
+    enum supported_capture_format s_fmt = capture_format_RGB24;
+    if (fmt != NULL) {
+        if (!str2capture_format(fmt, &s_fmt)) {
+            printf("Format %s is currently not implemented\n", fmt);
+            return NULL;
+        }
+        parse_resolution(res, &width, &height);
+    }
+
+    // a file of raw frames can also go through the read path of a device, frame by frame
+    bool read_file = fmt != NULL && options->capture_mode_forced &&
+                     (options->capture_mode == capture_mode_read || options->capture_mode == capture_mode_uring);
+    if (read_file) {
+        int frame_size = reader_frame_size(s_fmt, width, height);
+        int fd = frame_size > 0 ? open(path, O_RDONLY) : -1;
+        if (fd == -1) {
+            printf("Failed to open '%s' for reading, read and uring need an uncompressed format\n", path);
+            return NULL;
+        }
+        struct frame_reader* fr =
+            reader_new_with_options(fd, options->capture_mode, s_fmt, width, height, frame_size, &options->reader);
+        if (fr == NULL) {
+            printf("Failed to initialize the frame reader\n");
+            close(fd);
+            return NULL;
+        }
+        printf("Reading %s %dx%d with %s\n", pixfmt2str(capture_format2pixfmt(fr->fmt)), fr->width, fr->height,
+               capture_mode2str(options->capture_mode));
+        return fr;
     }
 
-    // query device capabilities
-    int query_cam = ioctl(fd, VIDIOC_QUERYCAP, &vid_caps);
-    if (query_cam == -1) {
-        printf("Failed to query camera!\n");
-        return 1;
+    options->replay.path = path;
+    struct frame_reader* fr = reader_new_replay(&options->replay, s_fmt, width, height, &options->reader);
+    if (fr == NULL) {
+        printf("Failed to open '%s' for replay\n", path);
+        return NULL;
     }
+    printf("Replaying %s %dx%d\n", pixfmt2str(capture_format2pixfmt(fr->fmt)), fr->width, fr->height);
+    return fr;
+}
 
-    // loading current fmt from device (this is only a sanity check)
-    vid_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    int read_fmt = ioctl(fd, VIDIOC_G_FMT, &vid_format);
-    if (read_fmt == -1) {
-        printf("Failed to read fmt\n");
+int replay(char* path, char* fmt, char* res, struct playground_options* options) {
+    struct frame_reader* fr = open_replay_reader(path, fmt, res, options);
+    if (fr == NULL) {
         return 1;
     }
 
-    vid_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vid_format.fmt.pix.width = width;
-    vid_format.fmt.pix.height = height;
-    vid_format.fmt.pix.pixelformat = str2pixfmt(fmt);
-    vid_format.fmt.pix.field = V4L2_FIELD_NONE;
-    vid_format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+    int status = display_frames(fr, "Replay", options);
 
+    close_frame_reader(fr, options);
+    return status;
+}
 
-    int put_fmt = ioctl(fd, VIDIOC_S_FMT, &vid_format);
-    if (put_fmt == -1) {
-        printf("Failed to write fmt\n");
-        return 1;
+// Read and decode frames as fast as possible and without a window, until the source ends or for seconds if > 0
+int bench_reader(struct frame_reader* fr, double seconds) {
+    if (-1 == reader_decode_thread_setup(fr)) {
+        printf("Failed to pin the decode thread\n");
     }
-
-    if (vid_format.fmt.pix.width != width || vid_format.fmt.pix.height != height) {
-        printf("Failed to set requested resoluition of %zux%zu, driver proposed %dx%d\n", width, height, vid_format.fmt.pix.width, vid_format.fmt.pix.height);
+    if (-1 == reader_start(fr)) {
+        printf("Failed to start streaming: %s\n", strerror(errno));
         return 1;
     }
+    struct frame_reader_latency* latency = calloc(1, sizeof(struct frame_reader_latency));
+    size_t frames = 0;
+    int status = 0;
+    double start = monotonic_seconds();
+    double elapsed = 0;
+    while (seconds <= 0 || elapsed < seconds) {
+        struct frame_reader_frame* frame = reader_read_frame(fr);
+        if (frame == NULL) {
+            if (errno != ENODATA) {
+                printf("Failed to read frame\n");
+                status = 1;
+            }
+            break;
+        }
+        struct frame_reader_frame decoded = *frame;
+        reader_latency_record(latency, reader_stage_dequeue, &decoded);
+        if (reader_decode_rgb(fr, frame) == NULL) {
+            printf("Failed to decode frame %u\n", decoded.sequence);
+            status = 1;
+            break;
+        }
+        reader_latency_record(latency, reader_stage_decode, &decoded);
+        frames++;
+        elapsed = monotonic_seconds() - start;
+    }
+    reader_stop(fr);
 
-    print_format(&vid_format);
+    printf("%zu frames in %.3f s (%.2f fps, %.1f MB/s decoded)\n", frames, elapsed, frames / elapsed,
+           frames * fr->width * fr->height * 3 / elapsed / 1e6);
+    print_reader_stats(fr);
+    print_latency(latency);
+    free(latency);
+    return status;
+}
 
-    // STEP 2.: Initialize the Frame Reader
-    enum supported_capture_mode s_mode = capture_mode_mmap;
-    if (!best_supported_capture_method(fd, &s_mode)) {
-        printf("No compatible captore method found\n");
+// Decode every frame of a recording once
+int bench(char* path, char* fmt, char* res, struct playground_options* options) {
+    options->replay.fast = true;
+    options->replay.loop = false;
+    struct frame_reader* fr = open_replay_reader(path, fmt, res, options);
+    if (fr == NULL) {
         return 1;
     }
 
-    printf("Using capture method %s\n", s_mode == capture_mode_mmap? "MMAP":"READ");
+    int status = bench_reader(fr, 0);
 
-    enum supported_capture_format s_fmt;
-    switch(str2pixfmt(fmt)) {
-        case V4L2_PIX_FMT_RGB24:
-            s_fmt = capture_format_RGB24;
-            break;
-        case V4L2_PIX_FMT_YUYV:
-            s_fmt = capture_format_YUYV;
-            break;
-        case V4L2_PIX_FMT_MJPEG:
-            s_fmt = capture_format_MJPEG;
-            break;
-        case V4L2_PIX_FMT_NV12:
-            s_fmt = capture_format_NV12;
-            break;
-        default:
-            printf("Format %s is currently not implemented", fmt);
-            return 1;
-    }
+    close_frame_reader(fr, options);
+    return status;
+}
 
-    fr = reader_new(fd, s_mode, s_fmt, width, height, vid_format.fmt.pix.sizeimage);
+bool str2pattern(char* str, enum frame_reader_pattern* pattern) {
+    if (strcmp(str, "bars") == 0) {
+        *pattern = reader_pattern_bars;
+        return true;
+    }
+    if (strcmp(str, "gradient") == 0) {
+        *pattern = reader_pattern_gradient;
+        return true;
+    }
+    if (strcmp(str, "noise") == 0) {
+        *pattern = reader_pattern_noise;
+        return true;
+    }
+    return false;
+}
 
-    // STEP 3.: Initialize the OpenGL
-    GLFWwindow* gl_ctx;
-    GLenum err;
+struct frame_reader* open_pattern_reader(char* pattern, char* fmt, char* res, struct playground_options* options) {
+    size_t width = 0;
+    size_t height = 0;
+    parse_resolution(res, &width, &height);
 
-    GLuint texture;
+    enum supported_capture_format s_fmt;
+    if (!str2pattern(pattern, &options->pattern.pattern) || !str2capture_format(fmt, &s_fmt)) {
+        printf("Pattern %s or format %s is not supported\n", pattern, fmt);
+        return NULL;
+    }
 
-    // create opengl context + window
-    glfwInit();
-    glfwDefaultWindowHints();
-    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
-    gl_ctx =
-        glfwCreateWindow(width, height, "Display OpenGL texture populated from video device", NULL, NULL);
-    if (!gl_ctx) {
-        printf("Failed to create opengl context\n");
-        return 1;
+    options->pattern.encode_jpeg = jpeg_encode;
+    struct frame_reader* fr = reader_new_pattern(&options->pattern, s_fmt, width, height, &options->reader);
+    if (fr == NULL) {
+        printf("Failed to generate %s %s %zux%zu, width and height have to be even and at most %dx%d\n", pattern, fmt,
+               width, height, READER_PATTERN_MAX_WIDTH, READER_PATTERN_MAX_HEIGHT);
     }
+    return fr;
+}
 
-    glfwMakeContextCurrent(gl_ctx);
-    err = glewInit();
-    if (GLEW_OK != err) {
-        printf("Failed to init glew\n");
+int show_pattern(char* pattern, char* fmt, char* res, struct playground_options* options) {
+    struct frame_reader* fr = open_pattern_reader(pattern, fmt, res, options);
+    if (fr == NULL) {
         return 1;
     }
 
-    // generate texture
-    glEnable(GL_TEXTURE_2D);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glGenTextures(1, &texture);
-
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    int status = display_frames(fr, "Test pattern", options);
 
-    reader_start(fr);
+    reader_destroy(fr);
+    return status;
+}
 
-     void* image_data = NULL;
+int bench_pattern(char* pattern, char* fmt, char* res, double seconds, struct playground_options* options) {
+    struct frame_reader* fr = open_pattern_reader(pattern, fmt, res, options);
+    if (fr == NULL) {
+        return 1;
+    }
 
-    while (1) {
+    int status = bench_reader(fr, seconds);
 
-        // STEP 4. Read images from the camera
-        image_data = reader_read_decode_rgb(fr);
+    reader_destroy(fr);
+    return status;
+}
 
-        // STEP 5. Transfer image to OpenGL texture
-        if (image_data != NULL) {
-            glTexImage2D(GL_TEXTURE_2D, 0, fr->texture_format, width, height, 0, fr->texture_format, GL_UNSIGNED_BYTE, image_data);
+// Parse a CPU list like "0-3,8", the format of taskset -c and /sys/devices/system/cpu/online
+bool parse_cpu_list(char* list, struct frame_reader_cpus* cpus) {
+    *cpus = (struct frame_reader_cpus){0};
+    char* p = list;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return false;
         }
-
-        // STEP 6. Draw Window
-        glViewport(0, 0, width, height);
-        glfwSetWindowSize(gl_ctx, width, height);
-        glBegin(GL_QUADS);
-        glTexCoord2f(OGLTX1);
-        glVertex2f(OGLBQ0);
-        glTexCoord2f(OGLTX0);
-        glVertex2f(OGLBQ1);
-        glTexCoord2f(OGLTX3);
-        glVertex2f(OGLBQ2);
-        glTexCoord2f(OGLTX2);
-        glVertex2f(OGLBQ3);
-
-        /*
-        glBegin(GL_QUADS);
-        glTexCoord2f(OGLTX0);
-        glVertex2f(OGLBQ0);
-        glTexCoord2f(OGLTX1);
-        glVertex2f(OGLBQ1);
-        glTexCoord2f(OGLTX2);
-        glVertex2f(OGLBQ2);
-        glTexCoord2f(OGLTX3);
-        glVertex2f(OGLBQ3);
-        */
-        glEnd();
-
-        glFlush();
-        glfwSwapBuffers(gl_ctx);
-
-        //usleep(1.0f / 30 * 1000000.0f);
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        if (first < 0 || last < first || last >= READER_MAX_CPUS || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            reader_cpus_set(cpus, cpu);
+        }
+        p = *end == ',' ? end + 1 : end;
     }
+    return !reader_cpus_empty(cpus);
+}
 
-    // TODO free everything
-
-    reader_stop(fr);
-
-
-    reader_destroy(fr);
-    close(fd);
-    return 0;
+bool parse_playground_option(char* arg, struct playground_options* options) {
+    if (strcmp(arg, "--policy=default") == 0) {
+        options->reader.policy = reader_policy_default;
+        return true;
+    }
+    if (strcmp(arg, "--policy=lowest-latency") == 0) {
+        options->reader.policy = reader_policy_lowest_latency;
+        return true;
+    }
+    if (strcmp(arg, "--policy=no-drop") == 0) {
+        options->reader.policy = reader_policy_no_drop;
+        return true;
+    }
+    if (strncmp(arg, "--buffers=", 10) == 0 && atoi(arg + 10) > 0) {
+        options->reader.capture_buffers_length = atoi(arg + 10);
+        return true;
+    }
+    if (strcmp(arg, "--capture-thread") == 0) {
+        options->capture_thread = true;
+        return true;
+    }
+    if (strcmp(arg, "--mailbox") == 0) {
+        // the mailbox lives between the capture thread and the consumer
+        options->capture_thread = true;
+        options->reader.handoff = reader_handoff_mailbox;
+        return true;
+    }
+    if (strcmp(arg, "--latency") == 0) {
+        options->latency = true;
+        return true;
+    }
+    if (strcmp(arg, "--export-dmabuf") == 0) {
+        options->reader.export_dmabuf = true;
+        return true;
+    }
+    if (strcmp(arg, "--hugepages") == 0) {
+        options->reader.alloc_flags |= READER_ALLOC_HUGEPAGES;
+        return true;
+    }
+    if (strcmp(arg, "--mlock") == 0) {
+        options->reader.alloc_flags |= READER_ALLOC_MLOCK;
+        return true;
+    }
+    if (strcmp(arg, "--mode=read") == 0) {
+        options->capture_mode_forced = true;
+        options->capture_mode = capture_mode_read;
+        return true;
+    }
+    if (strcmp(arg, "--mode=mmap") == 0) {
+        options->capture_mode_forced = true;
+        options->capture_mode = capture_mode_mmap;
+        return true;
+    }
+    if (strcmp(arg, "--mode=userptr") == 0) {
+        options->capture_mode_forced = true;
+        options->capture_mode = capture_mode_userptr;
+        return true;
+    }
+    if (strcmp(arg, "--mode=uring") == 0) {
+        options->capture_mode_forced = true;
+        options->capture_mode = capture_mode_uring;
+        return true;
+    }
+    if (strcmp(arg, "--fast") == 0) {
+        options->replay.fast = true;
+        return true;
+    }
+    if (strcmp(arg, "--loop") == 0) {
+        options->replay.loop = true;
+        return true;
+    }
+    if (strncmp(arg, "--capture-cpus=", 15) == 0) {
+        return parse_cpu_list(arg + 15, &options->reader.capture_cpus);
+    }
+    if (strncmp(arg, "--decode-cpus=", 14) == 0) {
+        return parse_cpu_list(arg + 14, &options->reader.decode_cpus);
+    }
+    if (strncmp(arg, "--sched=", 8) == 0) {
+        // the lowest real-time priority already runs before every normally scheduled thread
+        char* policy = arg + 8;
+        char* priority = strchr(policy, ':');
+        size_t length = priority != NULL ? (size_t)(priority - policy) : strlen(policy);
+        if (length == 4 && strncmp(policy, "fifo", 4) == 0) {
+            options->reader.capture_policy = SCHED_FIFO;
+        } else if (length == 2 && strncmp(policy, "rr", 2) == 0) {
+            options->reader.capture_policy = SCHED_RR;
+        } else {
+            return false;
+        }
+        options->reader.capture_priority =
+            priority != NULL ? atoi(priority + 1) : sched_get_priority_min(options->reader.capture_policy);
+        return true;
+    }
+    if (strcmp(arg, "--events") == 0) {
+        options->reader.events = READER_EVENT_SOURCE_CHANGE | READER_EVENT_EOS | READER_EVENT_CTRL;
+        return true;
+    }
+    if (strncmp(arg, "--watchdog=", 11) == 0 && atoi(arg + 11) > 0) {
+        options->reader.watchdog_intervals = atoi(arg + 11);
+        return true;
+    }
+    if (strncmp(arg, "--alt-resolution=", 17) == 0 && strstr(arg + 17, "x") != NULL) {
+        parse_resolution(arg + 17, &options->alt_width, &options->alt_height);
+        return options->alt_width > 0 && options->alt_height > 0;
+    }
+    if (strncmp(arg, "--fps=", 6) == 0 && atof(arg + 6) > 0) {
+        options->fps = atof(arg + 6);
+        options->replay.fps = atof(arg + 6);
+        options->pattern.fps = atof(arg + 6);
+        return true;
+    }
+    return false;
 }
 
 void usage() {
@@ -576,9 +1813,58 @@ void usage() {
         "   list-capture-methods <device>                              check is a given device is a webcam\n"
         "   list-formats <device>                           list a devices available formats\n"
         "   list-resolutions <device> <format>              list a devices available resolutions for a given format\n"
+        "   list-framerates <device> <format> <width>x<height> list a devices available frame rates for a given format "
+        "and resolution\n"
         "   is-supported <device> <format> <width>x<height> check if a resolution and format is supported by the "
         "device\n"
-        "   read-texture <device> <format> <width>x<height> read an image into a opengl texture and display\n");
+        "   read-texture <device> <format> <width>x<height> [options] read an image into a opengl texture and display\n"
+        "   count-frames <format> <width>x<height> <seconds> <device>... [options] capture from all devices on one "
+        "thread and print their frame rates\n"
+        "   record <device> <format> <width>x<height> <file> <frames> [options] capture frames into a recording\n"
+        "   replay <file> [<format> <width>x<height>] [options] display a recording, or a headerless file of raw "
+        "frames or concatenated JPEGs\n"
+        "   bench <file> [<format> <width>x<height>] [options] decode every frame of a file as fast as possible and "
+        "print the throughput\n"
+        "   pattern bars|gradient|noise <format> <width>x<height> [options] display a synthetic test pattern\n"
+        "   bench-pattern bars|gradient|noise <format> <width>x<height> <seconds> [options] decode a synthetic test "
+        "pattern as fast as possible and print the throughput\n");
+    printf(
+        "\n"
+        "Options (read-texture, count-frames, record, replay, bench, pattern, bench-pattern):\n"
+        "   --policy=default|lowest-latency|no-drop         buffer ring policy, lowest-latency always shows the newest "
+        "frame, no-drop queues deep\n"
+        "   --buffers=<n>                                   number of capture buffers to request (overrides the "
+        "policy)\n"
+        "   --mode=read|mmap|userptr|uring                  capture method, userptr captures into a pre-faulted pool "
+        "owned by the application, uring keeps a read per buffer in flight. replay, bench: read or uring read a "
+        "headerless file of raw frames instead of mapping it\n"
+        "   --export-dmabuf                                 export the capture buffers as DMABUF (mmap only)\n"
+        "   --hugepages                                     back decode, read, userptr and uring buffers with huge "
+        "pages\n"
+        "   --mlock                                         lock decode, read, userptr and uring buffers in memory\n"
+        "   --capture-thread                                dequeue on a dedicated capture thread (read-texture, "
+        "mmap, userptr and uring only)\n"
+        "   --mailbox                                       like --capture-thread but always hand out the newest "
+        "frame (triple buffering)\n"
+        "   --latency                                       print p50/p99/max capture to dequeue, decode, upload and "
+        "swap latency on exit\n"
+        "   --fast                                          replay: hand out frames as fast as they are taken instead "
+        "of at the recorded timing\n"
+        "   --loop                                          replay: start over at the end of the file\n"
+        "   --capture-cpus=<list>                           pin the capture thread (--capture-thread) to these CPUs, e.g. 2-3,6\n"
+        "   --sched=fifo|rr[:<priority>]                    run the capture thread under SCHED_FIFO or SCHED_RR "
+        "(default priority: the lowest real-time one)\n"
+        "   --decode-cpus=<list>                            pin the thread which decodes (read-texture, replay, bench, "
+        "pattern, bench-pattern) to these CPUs\n"
+        "   --watchdog=<n>                                  restart the stream when no frame came for n frame "
+        "intervals or a read failed, reopen the device if that does not help\n"
+        "   --events                                        read-texture: follow source changes (e.g. a new HDMI "
+        "resolution), stop at the end of the stream and print control changes (not with --mode=uring)\n"
+        "   --alt-resolution=<width>x<height>               read-texture, pattern: the R key switches between this "
+        "and the stream's resolution without reopening the device\n"
+        "   --fps=<n>                                       read-texture, count-frames, record: frame rate to request "
+        "from the device, replay, bench: frame rate of headerless files (default 30), pattern: frame rate (default "
+        "unlimited)\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -590,12 +1876,10 @@ int main(int argc, char* argv[]) {
     }
 
     if (strcmp("list-devices", argv[1]) == 0) {
-        char** video_devices = list_video_devices();
-        char** devices = list_devices(video_devices);
+        char** devices = list_devices();
         for (size_t i = 0; devices[i] != NULL; i++) {
             printf("%s\n", devices[i]);
         }
-        free_cpp(video_devices);
         free_cpp(devices);
         return 0;
     }
@@ -671,6 +1955,29 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    if (strcmp("list-framerates", argv[1]) == 0) {
+        if (argc != 5) {
+            usage();
+            return 1;
+        }
+
+        if (!is_webcam_device(argv[2])) {
+            printf("Device '%s' is NOT a webcam\n", argv[2]);
+            return 1;
+        }
+        if (strstr(argv[4], "x") == NULL) {
+            usage();
+            return 1;
+        }
+        char** framerates = list_device_framerates(argv[2], argv[3], argv[4]);
+        for (size_t i = 0; framerates[i] != NULL; i++) {
+            printf("%s\n", framerates[i]);
+        }
+        free_cpp(framerates);
+
+        return 0;
+    }
+
     if (strcmp("is-supported", argv[1]) == 0) {
         if (argc != 5) {
             usage();
@@ -688,11 +1995,19 @@ int main(int argc, char* argv[]) {
     }
 
     if (strcmp("read-texture", argv[1]) == 0) {
-        if (argc != 5) {
+        if (argc < 5) {
             usage();
             return 1;
         }
 
+        struct playground_options options = {0};
+        for (int i = 5; i < argc; i++) {
+            if (!parse_playground_option(argv[i], &options)) {
+                usage();
+                return 1;
+            }
+        }
+
         if (!is_webcam_device(argv[2])) {
             printf("Device '%s' is NOT a v4l2 loopback device\n", argv[2]);
             return 1;
@@ -703,7 +2018,137 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
-        return read_texture(argv[2], argv[3], argv[4]);
+        return read_texture(argv[2], argv[3], argv[4], &options);
+    }
+
+    if (strcmp("count-frames", argv[1]) == 0) {
+        if (argc < 6 || atof(argv[4]) <= 0) {
+            usage();
+            return 1;
+        }
+
+        struct playground_options options = {0};
+        char** devs = calloc(argc, sizeof(char*));
+        size_t devs_length = 0;
+        // every device is checked below, probe them all at once
+        device_registry_probe_all(get_device_registry());
+        for (int i = 5; i < argc; i++) {
+            if (strncmp(argv[i], "--", 2) == 0) {
+                if (!parse_playground_option(argv[i], &options)) {
+                    usage();
+                    free(devs);
+                    return 1;
+                }
+                continue;
+            }
+
+            if (!is_webcam_device(argv[i]) || !is_supported_format_resolution(argv[i], argv[2], argv[3])) {
+                printf("Device '%s' is NOT a webcam or does not support %s %s\n", argv[i], argv[2], argv[3]);
+                free(devs);
+                return 1;
+            }
+            devs[devs_length++] = argv[i];
+        }
+
+        if (devs_length == 0) {
+            usage();
+            free(devs);
+            return 1;
+        }
+
+        int status = count_frames(devs, devs_length, argv[2], argv[3], atof(argv[4]), &options);
+        free(devs);
+        return status;
+    }
+
+    if (strcmp("record", argv[1]) == 0) {
+        if (argc < 7 || atoi(argv[6]) <= 0) {
+            usage();
+            return 1;
+        }
+
+        struct playground_options options = {0};
+        for (int i = 7; i < argc; i++) {
+            if (!parse_playground_option(argv[i], &options)) {
+                usage();
+                return 1;
+            }
+        }
+
+        if (!is_webcam_device(argv[2]) || !is_supported_format_resolution(argv[2], argv[3], argv[4])) {
+            printf("Device '%s' is NOT a webcam or does not support %s %s\n", argv[2], argv[3], argv[4]);
+            return 1;
+        }
+
+        return record(argv[2], argv[3], argv[4], argv[5], atoi(argv[6]), &options);
+    }
+
+    if (strcmp("replay", argv[1]) == 0 || strcmp("bench", argv[1]) == 0) {
+        if (argc < 3) {
+            usage();
+            return 1;
+        }
+
+        // format and resolution are only needed for headerless files
+        char* fmt = NULL;
+        char* res = NULL;
+        int first_option = 3;
+        if (argc >= 5 && strncmp(argv[3], "--", 2) != 0) {
+            fmt = argv[3];
+            res = argv[4];
+            first_option = 5;
+            if (strstr(res, "x") == NULL) {
+                usage();
+                return 1;
+            }
+        }
+
+        struct playground_options options = {0};
+        for (int i = first_option; i < argc; i++) {
+            if (!parse_playground_option(argv[i], &options)) {
+                usage();
+                return 1;
+            }
+        }
+
+        if (strcmp("bench", argv[1]) == 0) {
+            return bench(argv[2], fmt, res, &options);
+        }
+        return replay(argv[2], fmt, res, &options);
+    }
+
+    if (strcmp("pattern", argv[1]) == 0) {
+        if (argc < 5 || strstr(argv[4], "x") == NULL) {
+            usage();
+            return 1;
+        }
+
+        struct playground_options options = {0};
+        for (int i = 5; i < argc; i++) {
+            if (!parse_playground_option(argv[i], &options)) {
+                usage();
+                return 1;
+            }
+        }
+
+        return show_pattern(argv[2], argv[3], argv[4], &options);
+    }
+
+    if (strcmp("bench-pattern", argv[1]) == 0) {
+        if (argc < 6 || strstr(argv[4], "x") == NULL || atof(argv[5]) <= 0) {
+            usage();
+            return 1;
+        }
+
+        struct playground_options options = {0};
+        for (int i = 6; i < argc; i++) {
+            if (!parse_playground_option(argv[i], &options)) {
+                usage();
+                return 1;
+            }
+        }
+
+        return bench_pattern(argv[2], argv[3], argv[4], atof(argv[5]), &options);
     }
 
     usage();
@@ -0,0 +1,67 @@
+// Frames the reader skips or supersedes itself must not stay held, a restart of the stream has to queue every
+// buffer again.
+#define STB_IMAGE_IMPLEMENTATION
+#include "frame_reader.h"
+
+#include <assert.h>
+
+void check_all_queued(struct frame_reader* reader) {
+    for (size_t i = 0; i < reader->capture_buffers_length; ++i) {
+        assert(atomic_load(&reader->buffer_holds[i]) == 0);
+    }
+    assert(0 == reader_restart_stream(reader));
+    struct frame_source_pattern* pattern = reader->source_data;
+    assert(pattern->held == 0);
+}
+
+void test_lowest_latency() {
+    struct frame_source_pattern_options pattern_options = {.pattern = reader_pattern_bars};
+    struct frame_reader_options options = {.policy = reader_policy_lowest_latency};
+    struct frame_reader* reader = reader_new_pattern(&pattern_options, capture_format_RGB24, 64, 32, &options);
+    assert(reader != NULL && 0 == reader_start(reader));
+
+    for (int i = 0; i < 16; ++i) {
+        assert(reader_read_frame(reader) != NULL);
+    }
+    reader_release_current(reader);
+    assert(reader_stats(reader).frames_skipped > 0);
+    check_all_queued(reader);
+
+    reader_stop(reader);
+    reader_destroy(reader);
+}
+
+void test_mailbox() {
+    struct frame_source_pattern_options pattern_options = {.pattern = reader_pattern_bars};
+    struct frame_reader_options options = {.handoff = reader_handoff_mailbox};
+    struct frame_reader* reader = reader_new_pattern(&pattern_options, capture_format_RGB24, 64, 32, &options);
+    assert(reader != NULL && 0 == reader_start(reader) && 0 == reader_thread_start(reader));
+
+    for (int i = 0; i < 16; ++i) {
+        assert(reader_thread_wait(reader, 1000) == 1);
+        struct frame_reader_frame* frame = reader_thread_pop(reader);
+        if (frame != NULL) {
+            usleep(1000);
+            reader_thread_release(reader, frame);
+        }
+    }
+    reader_thread_stop(reader);
+    assert(reader_stats(reader).frames_superseded > 0);
+    // the frame left in the mailbox is still held until it is taken
+    struct frame_reader_frame* pending = reader_thread_pop(reader);
+    if (pending != NULL) {
+        reader_thread_release(reader, pending);
+    }
+    reader_requeue_released(reader);
+    check_all_queued(reader);
+
+    reader_stop(reader);
+    reader_destroy(reader);
+}
+
+int main() {
+    test_lowest_latency();
+    test_mailbox();
+    puts("ok");
+    return 0;
+}